@@ -32,6 +32,10 @@ enum RequestTermConnectorMode
 {
 	rtc_Start = 1,
 	rtc_Stop  = 2,
+	// Called after rtc_Start with cbSize == sizeof(RequestTermConnectorParm),
+	// the host fills the optional callbacks it supports. Older hosts fail
+	// the unknown mode and the callbacks stay NULL.
+	rtc_Extensions = 3,
 };
 
 #ifndef WRITE_PROCESSED_STREAM_DEFINED
@@ -81,4 +85,13 @@ struct RequestTermConnectorParm
 	// [OUT] But this is ANSI (UTF-8 is expected)
 	//       cbWrite==-1 : pBuffer contains ASCIIZ string, call strlen on it
 	BOOL (WINAPI* WriteText)(LPCSTR pBuffer, DWORD cbWrite, PDWORD pcbWritten, enum WriteProcessedStream nStream);
+
+	// Members below are filled by rtc_Extensions only. rtc_Start and rtc_Stop
+	// pass RTC_PARM_BASE_SIZE in cbSize, hosts compare it for equality.
+
+	// [OUT] Optional, NULL if not supported. Returns FALSE while the tab is hidden (inactive tab,
+	//       minimized window), the output of hidden tab is kept and repainted when the tab is shown
+	BOOL (WINAPI* IsTabVisible)();
 };
+
+#define RTC_PARM_BASE_SIZE offsetof(struct RequestTermConnectorParm, IsTabVisible)
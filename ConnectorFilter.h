@@ -0,0 +1,75 @@
+
+/*
+Copyright (c) 2015-present Maximus5
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the authors may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+/*
+Output filter plugins, loaded by `connector --filter <library>[,arg]`.
+The library exports `ConnectorFilterInit` (see ConnectorFilterInit_t).
+Filters receive the shell output as tokens: text runs and complete escape
+sequences. Spans point into the read buffer of the connector and are valid
+during the call only. A filter returns FALSE to pass the token to the next
+filter, or TRUE when the token was dropped or replaced by Emit calls.
+*/
+
+// the same order as VtTokenType in connector.cpp
+enum ConnectorTokenType
+{
+	ctt_Text = 0, // printable text and control characters
+	ctt_Esc  = 1, // ESC + intermediates + final
+	ctt_CSI  = 2, // ESC [ params intermediates final
+	ctt_OSC  = 3, // ESC ] ... BEL or ST
+	ctt_DCS  = 4, // ESC P ... ST
+	ctt_Str  = 5, // SOS, PM, APC
+	ctt_Raw  = 6, // part of too long or unfinished sequence
+};
+
+struct ConnectorFilterParm
+{
+	// [IN]  size in bytes of this structure
+	DWORD cbSize;
+	// [IN]  text after comma in `--filter <library>,arg`, or NULL
+	LPCSTR pszArg;
+	// [IN]  this filter in the chain, first argument of Emit
+	void* pChain;
+	// [IN]  pass a span to the following filters, may be called from Token, BatchEnd and Idle.
+	//       Spans of the current token are not copied, other data is copied.
+	void (WINAPI* Emit)(void* pChain, enum ConnectorTokenType nType, LPCSTR pData, int cbData);
+	// [OUT] name of the filter for diagnostics, optional
+	LPCSTR pszName;
+	// [OUT] first argument of the callbacks
+	void* pContext;
+	// [OUT] required, TRUE if the token was consumed
+	BOOL (WINAPI* Token)(void* pContext, enum ConnectorTokenType nType, LPCSTR pData, int cbData);
+	// [OUT] optional, all tokens of the read from pty were processed
+	void (WINAPI* BatchEnd)(void* pContext);
+	// [OUT] optional, there was no output for a while
+	void (WINAPI* Idle)(void* pContext);
+};
+
+// returns 0 on success
+typedef int (WINAPI* ConnectorFilterInit_t)(struct ConnectorFilterParm* pParm);
@@ -47,18 +47,31 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <process.h>
 #include <signal.h>
 #include <time.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/fcntl.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <regex.h>
 #include <sys/termios.h>
 #include <sys/cygwin.h>
 
@@ -72,21 +85,28 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // exists in cygwin+msys2
 #if defined(HAS_FORKPTY)
 #include <pty.h>
+#include <spawn.h>
 #endif
 
 #define _max(a,b) (((a) > (b)) ? (a) : (b))
+#define _min(a,b) (((a) < (b)) ? (a) : (b))
 
 bool verbose = false;
 bool debugger = false;
+bool show_stats = false;
 static int gnLogFileIn = -1;
 static int gnLogFileOut = -1;
+static bool log_compress = false;
 void safe_close(int& f);
+static void write_log(int log_file, const char* buf, int len);
+static void close_log_files();
 char* get_cygwin_root();
 
 static void write_verbose(const char *buf, ...);
 static void print_version();
 
 #include "version.h"
+#include "lz4frame.h"
 
 
 #include "ConnectorAPI.h"
@@ -94,6 +114,8 @@ static void print_version();
 // enum WriteProcessedStream
 // struct tag_RequestTermConnectorParm
 
+#include "ConnectorFilter.h"
+
 
 static HMODULE hConEmuHk = NULL;
 static RequestTermConnectorParm Connector = {};
@@ -147,7 +169,7 @@ static int RequestTermConnector()
 	{
 		// Prepare arguments
 		memset(&Connector, 0, sizeof(Connector));
-		Connector.cbSize = sizeof(Connector);
+		Connector.cbSize = RTC_PARM_BASE_SIZE;
 		Connector.Mode = rtc_Start;
 		Connector.pszTtyName = ttyname(STDOUT_FILENO);
 		Connector.pszTerm = getenv("TERM");
@@ -165,6 +187,19 @@ static int RequestTermConnector()
 			write_verbose("\r\n{PID:%u} RequestTermConnector returned NULL. %s\r\n", getpid(), Connector.pszError ? Connector.pszError : "");
 			iRc = -1;
 		}
+		else
+		{
+			// Optional callbacks, older hosts don't know the mode.
+			// The copy keeps Connector intact whatever they do with it.
+			RequestTermConnectorParm ext = Connector;
+			ext.cbSize = sizeof(ext);
+			ext.Mode = rtc_Extensions;
+			ext.IsTabVisible = NULL;
+			if (fnRequestTermConnector(&ext) == 0)
+				Connector.IsTabVisible = ext.IsTabVisible;
+			else if (verbose)
+				write_verbose("\r\n{PID:%u} RequestTermConnector extensions are not supported\r\n", getpid());
+		}
 	}
 
 	if (iRc != 0)
@@ -179,15 +214,14 @@ static void StopTermConnector()
 {
 	if (fnRequestTermConnector)
 	{
-		Connector.cbSize = sizeof(Connector);
+		Connector.cbSize = RTC_PARM_BASE_SIZE;
 		Connector.Mode = rtc_Stop;
 		fnRequestTermConnector(&Connector);
 	}
 
 	memset(&Connector, 0, sizeof(Connector));
 
-	safe_close(gnLogFileIn);
-	safe_close(gnLogFileOut);
+	close_log_files();
 
 	if (hConEmuHk)
 	{
@@ -220,9 +254,18 @@ static void debug_log_format(const char* format,...)
 static int pty_fd = -1, pty_err = -1;
 static int slave_std_err = -1, slave_std_out = -1;
 static pid_t pid = -1;
+static pid_t session_id = -1;       // pid of the shell, it's the leader of the session and process group
+static int child_status = -1;       // waitpid status of the shell, -1 if it's still running
 static void stop_threads();
 static bool termination = false;
+// SIGCHLD and termination signals are delivered into the pump loops through the self-pipe
+static int sigchld_pipe[2] = {-1, -1};
+static volatile sig_atomic_t exit_signal = 0;
 static int check_child(bool force_print = false);
+static int ce_forkpty(int *pmaster, int *pmaster_err, struct winsize *winp);
+static ssize_t write_pty(const char* data, int len);
+static void predict_key(const char* s, int len);
+static void query_input(const char* s, int len);
 
 static BOOL WINAPI CtrlHandlerRoutine(DWORD dwCtrlType)
 {
@@ -274,7 +317,7 @@ static void sigexit(int sig)
 		// We do not expect to receive SIGINT because of ProtectCtrlBreakTrap
 		if (verbose)
 			write_verbose("\r\n\033[31;40m{PID:%u} Passing ^C to client\033[m\r\n", getpid());
-		write(pty_fd, "\3", 1);
+		write_pty("\3", 1);
 		//if (pid > 0)
 		//	kill(pid, sig); // or kill(-group, sig)
 		return;
@@ -282,6 +325,28 @@ static void sigexit(int sig)
 
 	if (pid > 0)
 		kill(-pid, SIGHUP);
+	// Closing of the logs locks the mutex and joins the writer thread,
+	// that may deadlock here: the pump loop stops and calls exit_on_signal()
+	exit_signal = sig;
+	if (sigchld_pipe[1] >= 0)
+	{
+		int e = errno;
+		write(sigchld_pipe[1], "T", 1);
+		errno = e;
+		return;
+	}
+	// there is no pump loop yet, the logs are not flushed
+	termination = true;
+	signal(sig, SIG_DFL);
+	kill(getpid(), sig);
+}
+
+// Called by the pump loops after cleanup, when they were stopped by sigexit()
+static void exit_on_signal()
+{
+	int sig = exit_signal;
+	if (!sig)
+		return;
 	stop_threads();
 	signal(sig, SIG_DFL);
 	kill(getpid(), sig);
@@ -336,6 +401,464 @@ static void sigfault(int sig)
 }
 
 
+// DEC private modes tracked in the output stream,
+// they are stored in log index keyframes and used to answer the queries
+enum TermModeBits
+{
+	tm_CursorKeys   = 0x0001, // ?1
+	tm_Origin       = 0x0002, // ?6
+	tm_AutoWrap     = 0x0004, // ?7
+	tm_CursorShow   = 0x0008, // ?25
+	tm_AltScreen    = 0x0010, // ?47, ?1047, ?1049
+	tm_MouseX10     = 0x0020, // ?1000
+	tm_MouseButton  = 0x0040, // ?1002
+	tm_MouseAny     = 0x0080, // ?1003
+	tm_MouseSgr     = 0x0100, // ?1006
+	tm_BracketPaste = 0x0200, // ?2004
+	tm_SyncOutput   = 0x0400, // ?2026
+	tm_Default      = tm_AutoWrap|tm_CursorShow,
+};
+static unsigned term_modes = tm_Default;
+// Modes at the end of the logged output, they may differ from term_modes
+// by the gather buffer and held frames; keyframes are placed between tokens only
+static unsigned log_modes = tm_Default;
+static bool log_mid_token = false;
+
+// Log files are written by the background thread,
+// the pump only copies the data into memory blocks.
+// With `--log-compress` the blocks are stored in LZ4 frame format,
+// such logs may be read by `lz4cat` or by `connector --cat-log <file>`.
+#define LOG_BLOCK_SIZE LZ4F_BLOCK_SIZE
+struct LogBlock
+{
+	LogBlock* next;
+	int used;
+	// the block starts at the index keyframe
+	bool has_key;
+	long long key_time_ms;
+	long long key_offset;
+	unsigned key_modes;
+	char data[LOG_BLOCK_SIZE];
+};
+struct LogStream
+{
+	int* pfd;                 // &gnLogFileIn or &gnLogFileOut
+	LogBlock* cur;            // being filled by the pump
+	LogBlock *head, *tail;    // queued for the writer
+	int queued;
+	// segments, see log_rotate
+	char* path;               // name of the first segment
+	int ext_pos;              // position of ".log" in the path
+	int segment;              // current segment number
+	time_t opened;            // when the current segment was created
+	// sidecar index "connector-PID-out.idx", see log_write_index
+	int idx_fd;
+	long long offset;         // bytes passed to the stream since start
+	long long next_key_offset;
+	time_t next_key_time;
+};
+static LogStream log_streams[2] = {{&gnLogFileIn, NULL, NULL, NULL, 0, NULL, 0, 0, 0, -1}, {&gnLogFileOut, NULL, NULL, NULL, 0, NULL, 0, 0, 0, -1}};
+static pthread_t log_writer;
+static pid_t log_writer_pid = 0; // writer thread does not exist in forked children
+static bool log_writer_stop = false;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_space_cond = PTHREAD_COND_INITIALIZER;
+const int log_max_queued = 64;   // the pump waits if the disk can't keep up with 4MiB per stream
+const int log_flush_period = 1;  // seconds, partial blocks are written at least this often
+// Segments: `--log-size`, `--log-age` and `--log-keep`
+static off_t log_max_size = 0;   // bytes, 0 means unlimited; segments are preallocated to this size
+static int log_max_age = 0;      // seconds, 0 means unlimited
+static int log_keep = 0;         // number of segments to keep, 0 means keep all
+
+static void log_write_block(int fd, const char* data, int len)
+{
+	if (fd < 0 || len <= 0)
+		return;
+	if (!log_compress)
+	{
+		write(fd, data, len);
+		return;
+	}
+
+	static char packed[4 + LZ4_COMPRESS_BOUND(LOG_BLOCK_SIZE)];
+	int packed_len = lz4_compress_block(data, len, packed + 4, sizeof(packed) - 4);
+	if (packed_len > 0 && packed_len < len)
+	{
+		lz4_write32((unsigned char*)packed, packed_len);
+	}
+	else
+	{
+		lz4_write32((unsigned char*)packed, len | LZ4F_UNCOMPRESSED);
+		memcpy(packed + 4, data, len);
+		packed_len = len;
+	}
+	write(fd, packed, packed_len + 4);
+}
+
+// Index of the out-log: header and fixed size records, so tools may
+// find the keyframe by time or by offset with binary search.
+// The keyframe always starts new log block, so it's possible to start
+// decompression of the LZ4 segment right from the file_offset.
+#define LOG_INDEX_MAGIC "CEIDX01\n"
+#define LOG_INDEX_RECORD 32
+const long long log_index_bytes = 1024*1024;  // keyframe after this amount of output
+const int log_index_period = 10;              // or after this amount of seconds
+struct LogIndexRecord
+{
+	long long time_ms;       // unix time of the keyframe
+	long long offset;        // offset in the (uncompressed) stream
+	long long file_offset;   // offset in the segment file
+	int segment;
+	unsigned modes;          // TermModeBits
+};
+
+static void put_le64(unsigned char* p, unsigned long long v)
+{
+	lz4_write32(p, (unsigned)v);
+	lz4_write32(p + 4, (unsigned)(v >> 32));
+}
+
+static unsigned long long get_le64(const unsigned char* p)
+{
+	return lz4_read32(p) | ((unsigned long long)lz4_read32(p + 4) << 32);
+}
+
+static void log_write_index(LogStream& ls, int fd, const LogBlock* block)
+{
+	unsigned char rec[LOG_INDEX_RECORD];
+	put_le64(rec, block->key_time_ms);
+	put_le64(rec + 8, block->key_offset);
+	put_le64(rec + 16, lseek(fd, 0, SEEK_CUR));
+	lz4_write32(rec + 24, ls.segment);
+	lz4_write32(rec + 28, block->key_modes);
+	write(ls.idx_fd, rec, sizeof(rec));
+}
+
+static bool log_read_index(int idx_fd, long long n, LogIndexRecord& rec)
+{
+	unsigned char buf[LOG_INDEX_RECORD];
+	if (pread(idx_fd, buf, sizeof(buf), sizeof(LOG_INDEX_MAGIC) - 1 + n * LOG_INDEX_RECORD) != sizeof(buf))
+		return false;
+	rec.time_ms = get_le64(buf);
+	rec.offset = get_le64(buf + 8);
+	rec.file_offset = get_le64(buf + 16);
+	rec.segment = lz4_read32(buf + 24);
+	rec.modes = lz4_read32(buf + 28);
+	return true;
+}
+
+static long long system_realtime_ms()
+{
+	#if defined(HAS_FORKPTY)
+	struct timespec ts = {};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	#else
+	return (long long)time(0) * 1000;  // msys1 does not have clock_gettime
+	#endif
+}
+
+static long long system_time_us()
+{
+	#if defined(HAS_FORKPTY)
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	#else
+	return (long long)GetTickCount() * 1000;  // msys1 does not have clock_gettime
+	#endif
+}
+
+static int system_wait(int nfds, fd_set* readfds, long long timeout_us)
+{
+	struct timeval timeout = {(long)(timeout_us / 1000000), (long)(timeout_us % 1000000)};
+	return select(nfds, readfds, 0, 0, &timeout);
+}
+
+// Sources of time for the pump: deadlines, budgets and timeouts are taken from here.
+// System clocks by default, `--simulate` replaces them with the virtual clock.
+struct PumpClock
+{
+	long long (*now_us)();          // monotonic time in microseconds
+	long long (*realtime_ms)();     // wall clock for reports
+	int (*wait)(int nfds, fd_set* readfds, long long timeout_us);  // select() on readable descriptors
+};
+static PumpClock pump_clock = {system_time_us, system_realtime_ms, system_wait};
+
+static long long get_realtime_ms()
+{
+	return pump_clock.realtime_ms();
+}
+
+// Monotonic time in microseconds, used for latency measurements
+static long long get_time_us()
+{
+	return pump_clock.now_us();
+}
+
+// "connector-PID-out.log", "connector-PID-out.1.log", "connector-PID-out.2.log", ...
+static char* log_segment_name(const LogStream& ls, int segment)
+{
+	char* name = (char*)malloc(strlen(ls.path) + 16);
+	if (!name)
+		return NULL;
+	if (segment == 0)
+	{
+		strcpy(name, ls.path);
+	}
+	else
+	{
+		memcpy(name, ls.path, ls.ext_pos);
+		sprintf(name + ls.ext_pos, ".%i%s", segment, ls.path + ls.ext_pos);
+	}
+	return name;
+}
+
+// Reserve disk space for the whole segment to avoid allocation stalls during output bursts
+static void log_prealloc(int fd)
+{
+	#if defined(HAS_FORKPTY)
+	if (log_max_size > 0)
+		posix_fallocate(fd, lseek(fd, 0, SEEK_CUR), log_max_size);
+	#endif
+}
+
+static void log_segment_started(int fd)
+{
+	// There is some permission crazyness while creating new files
+	fchmod(fd, 0600);
+
+	if (log_compress)
+	{
+		unsigned char header[LZ4F_HEADER_SIZE];
+		write(fd, header, lz4_frame_header(header));
+	}
+
+	log_prealloc(fd);
+}
+
+static void log_segment_finished(int fd)
+{
+	if (log_compress)
+	{
+		// LZ4 frame EndMark
+		const char end_mark[4] = {};
+		write(fd, end_mark, sizeof(end_mark));
+	}
+
+	// drop unused preallocated tail
+	if (log_max_size > 0)
+		ftruncate(fd, lseek(fd, 0, SEEK_CUR));
+}
+
+static bool log_need_rotate(const LogStream& ls, int fd, int len)
+{
+	if (!ls.path)
+		return false;
+	if (log_max_age > 0 && (time(0) - ls.opened) >= log_max_age)
+		return true;
+	if (log_max_size > 0 && (lseek(fd, 0, SEEK_CUR) + len + 8) > log_max_size)
+		return true;
+	return false;
+}
+
+// Called from the writer thread only. The descriptor number is kept
+// (dup2) so gnLogFileIn/gnLogFileOut remain valid for the pump.
+static void log_rotate(LogStream& ls)
+{
+	int fd = *ls.pfd;
+	char* name = log_segment_name(ls, ls.segment + 1);
+	int new_fd = name ? open(name, O_WRONLY|O_CREAT|O_TRUNC, 0600) : -1;
+	free(name);
+	ls.opened = time(0);
+	if (new_fd < 0)
+		return; // continue writing to the current segment
+
+	log_segment_finished(fd);
+	dup2(new_fd, fd);
+	close(new_fd);
+	ls.segment++;
+
+	log_segment_started(fd);
+	char title[80];
+	int title_len = sprintf(title, "connector-%u segment %i\n----------\n", getpid(), ls.segment);
+	log_write_block(fd, title, title_len);
+
+	// retention policy
+	if (log_keep > 0 && ls.segment >= log_keep)
+	{
+		char* old_name = log_segment_name(ls, ls.segment - log_keep);
+		if (old_name)
+			unlink(old_name);
+		free(old_name);
+	}
+}
+
+static void log_enqueue(LogStream& ls)
+{
+	if (!ls.cur)
+		return;
+	if (ls.tail)
+		ls.tail->next = ls.cur;
+	else
+		ls.head = ls.cur;
+	ls.tail = ls.cur;
+	ls.cur = NULL;
+	ls.queued++;
+}
+
+static void* log_writer_thread(void*)
+{
+	for (;;)
+	{
+		LogBlock* blocks[2] = {};
+		int wait_rc = 0;
+
+		pthread_mutex_lock(&log_mutex);
+		while (!log_streams[0].head && !log_streams[1].head && !log_writer_stop && wait_rc != ETIMEDOUT)
+		{
+			struct timespec deadline = {};
+			deadline.tv_sec = time(0) + log_flush_period;
+			wait_rc = pthread_cond_timedwait(&log_cond, &log_mutex, &deadline);
+		}
+		bool stop = log_writer_stop;
+		for (int i = 0; i < 2; ++i)
+		{
+			LogStream& ls = log_streams[i];
+			if ((stop || wait_rc == ETIMEDOUT) && ls.cur && ls.cur->used)
+				log_enqueue(ls);
+			blocks[i] = ls.head;
+			ls.head = ls.tail = NULL;
+			ls.queued = 0;
+		}
+		pthread_cond_broadcast(&log_space_cond);
+		pthread_mutex_unlock(&log_mutex);
+
+		for (int i = 0; i < 2; ++i)
+		{
+			while (blocks[i])
+			{
+				LogBlock* next = blocks[i]->next;
+				int fd = *log_streams[i].pfd;
+				if (fd >= 0 && log_need_rotate(log_streams[i], fd, blocks[i]->used))
+					log_rotate(log_streams[i]);
+				if (fd >= 0 && blocks[i]->has_key && log_streams[i].idx_fd >= 0)
+					log_write_index(log_streams[i], fd, blocks[i]);
+				log_write_block(fd, blocks[i]->data, blocks[i]->used);
+				free(blocks[i]);
+				blocks[i] = next;
+			}
+		}
+
+		if (stop)
+			break;
+	}
+	return NULL;
+}
+
+static void start_log_writer()
+{
+	if (log_writer_pid)
+		return;
+	log_writer_stop = false;
+	if (pthread_create(&log_writer, NULL, log_writer_thread, NULL) == 0)
+		log_writer_pid = getpid();
+	else if (log_compress)
+		write_verbose("\r\n\033[31;40m{PID:%u} failed to start log writer thread, logging is disabled\033[m\r\n", getpid());
+	else
+		write_verbose("\r\n\033[31;40m{PID:%u} failed to start log writer thread, logging synchronously\033[m\r\n", getpid());
+}
+
+static void write_log(int log_file, const char* buf, int len)
+{
+	if (log_file < 0 || len <= 0)
+		return;
+	if (log_writer_pid != getpid())
+	{
+		// writer thread failed to start, compression is impossible here
+		if (!log_compress)
+			write(log_file, buf, len);
+		return;
+	}
+
+	LogStream& ls = (log_file == gnLogFileIn) ? log_streams[0] : log_streams[1];
+	pthread_mutex_lock(&log_mutex);
+
+	// Keyframe starts new block
+	bool key = (ls.idx_fd >= 0) && !log_mid_token && (ls.offset >= ls.next_key_offset || time(0) >= ls.next_key_time);
+	if (key && ls.cur && ls.cur->used)
+	{
+		log_enqueue(ls);
+		pthread_cond_signal(&log_cond);
+	}
+
+	while (len > 0)
+	{
+		if (!ls.cur)
+		{
+			ls.cur = (LogBlock*)malloc(sizeof(LogBlock));
+			if (!ls.cur)
+				break;
+			ls.cur->next = NULL;
+			ls.cur->used = 0;
+			ls.cur->has_key = false;
+		}
+		if (key)
+		{
+			ls.cur->has_key = true;
+			ls.cur->key_time_ms = get_realtime_ms();
+			ls.cur->key_offset = ls.offset;
+			ls.cur->key_modes = log_modes;
+			ls.next_key_offset = ls.offset + log_index_bytes;
+			ls.next_key_time = time(0) + log_index_period;
+			key = false;
+		}
+		int part = LOG_BLOCK_SIZE - ls.cur->used;
+		if (part > len)
+			part = len;
+		memcpy(ls.cur->data + ls.cur->used, buf, part);
+		ls.cur->used += part;
+		ls.offset += part;
+		buf += part; len -= part;
+
+		if (ls.cur->used == LOG_BLOCK_SIZE)
+		{
+			while (ls.queued >= log_max_queued && !log_writer_stop)
+				pthread_cond_wait(&log_space_cond, &log_mutex);
+			log_enqueue(ls);
+			pthread_cond_signal(&log_cond);
+		}
+	}
+	pthread_mutex_unlock(&log_mutex);
+}
+
+// Flush pending blocks and close both log files
+static void close_log_files()
+{
+	if (log_writer_pid && log_writer_pid == getpid())
+	{
+		pthread_mutex_lock(&log_mutex);
+		log_writer_stop = true;
+		pthread_cond_broadcast(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+		pthread_join(log_writer, NULL);
+		log_writer_pid = 0;
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		if (*log_streams[i].pfd >= 0)
+			log_segment_finished(*log_streams[i].pfd);
+		free(log_streams[i].path);
+		log_streams[i].path = NULL;
+		safe_close(log_streams[i].idx_fd);
+	}
+
+	safe_close(gnLogFileIn);
+	safe_close(gnLogFileOut);
+}
+
 static void log_system_time(bool force)
 {
 	if (gnLogFileOut < 0)
@@ -358,14 +881,184 @@ static void log_system_time(bool force)
 			const struct tm* ltm;
 			ltm = localtime(&ts.tv_sec);
 			sprintf(log_time, "\x1B]9;11;\"%02i:%02i:%02i.%03i\"\x07", ltm->tm_hour, ltm->tm_min, ltm->tm_sec, ts.tv_nsec / 1000000);
-			write(gnLogFileOut, log_time, strlen(log_time));
+			write_log(gnLogFileOut, log_time, strlen(log_time));
 			if (!force)
 				last_ms = cur_ms;
 		}
 	}
 }
 
-static bool write_console(const char *buf, int len, WriteProcessedStream strm = wps_Output)
+// Timeline of the pump for Perfetto or chrome://tracing, switch `--trace <file>`.
+// Spans are stored into the ring buffer allocated on start, the JSON is written on exit,
+// so the tracing does not add syscalls into the measured loop. When the buffer is
+// full the oldest spans are overwritten, the moments before exit matter most.
+#define TRACE_MAX_EVENTS (256*1024)  // power of 2
+struct TraceEvent
+{
+	const char* name;
+	long long start_us;
+	int dur_us;
+	int arg;                // bytes, events or result of the call, -1 if not used
+};
+struct TraceBuffer
+{
+	char* path;
+	TraceEvent* events;     // NULL if tracing is off
+	unsigned long long total;  // spans recorded, the last TRACE_MAX_EVENTS are kept
+	pid_t pid;              // forked children don't write the file
+	long long origin_us;
+};
+static TraceBuffer trace = {};
+
+static long long trace_begin()
+{
+	return trace.events ? get_time_us() : 0;
+}
+
+static void trace_span(const char* name, long long start_us, int dur_us, int arg = -1)
+{
+	if (!trace.events)
+		return;
+	TraceEvent& ev = trace.events[trace.total++ & (TRACE_MAX_EVENTS - 1)];
+	ev.name = name;
+	ev.start_us = start_us;
+	ev.dur_us = dur_us;
+	ev.arg = arg;
+}
+
+static void trace_end(const char* name, long long start_us, int arg = -1)
+{
+	if (trace.events)
+		trace_span(name, start_us, (int)(get_time_us() - start_us), arg);
+}
+
+static void trace_write()
+{
+	if (!trace.events || trace.pid != getpid())
+		return;
+	FILE* f = fopen(trace.path, "wb");
+	if (!f)
+	{
+		write_verbose("\r\n\033[31;40m{PID:%u} can't create trace `%s`: %s\033[m\r\n", getpid(), trace.path, strerror(errno));
+		return;
+	}
+	fprintf(f, "{\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":1,\"args\":{\"name\":\"connector\"}}", trace.pid);
+	unsigned count = (trace.total > TRACE_MAX_EVENTS) ? TRACE_MAX_EVENTS : (unsigned)trace.total;
+	unsigned dropped = (unsigned)(trace.total - count);
+	for (unsigned long long i = trace.total - count; i < trace.total; ++i)
+	{
+		const TraceEvent& ev = trace.events[i & (TRACE_MAX_EVENTS - 1)];
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%i,\"pid\":%u,\"tid\":1",
+			ev.name, ev.start_us - trace.origin_us, ev.dur_us, trace.pid);
+		if (ev.arg != -1)
+			fprintf(f, ",\"args\":{\"n\":%i}", ev.arg);
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"events\":%u,\"dropped\":%u}}\n", count, dropped);
+	fclose(f);
+	if (verbose || show_stats)
+		write_verbose("\r\n\033[32;40m{PID:%u} trace: %u spans (%u older dropped) written to `%s`\033[m\r\n", getpid(), count, dropped, trace.path);
+	free(trace.events);
+	trace.events = NULL;
+}
+
+static void start_trace(char* path)
+{
+	trace.events = (TraceEvent*)malloc(TRACE_MAX_EVENTS * sizeof(TraceEvent));
+	if (!trace.events)
+	{
+		write_verbose("\r\n\033[31;40m{PID:%u} not enough memory for trace buffer\033[m\r\n", getpid());
+		return;
+	}
+	// touch the pages now, not in the measured loop
+	memset(trace.events, 0, TRACE_MAX_EVENTS * sizeof(TraceEvent));
+	trace.path = path;
+	trace.pid = getpid();
+	trace.origin_us = get_time_us();
+	atexit(trace_write);
+}
+
+// Interactive echo tracking.
+// When we write the input to pty_fd the shell (or tty driver) echoes it back.
+// If the output flood is running, the echo is queued behind the bulk output,
+// so while the echo is expected we drain pty more aggressively and
+// don't wait for coalescing of the small reads.
+struct EchoStats
+{
+	long long input_us;     // when the last input was written to pty, 0 if echo is not expected
+	unsigned  samples;      // number of measured echoes
+	unsigned  expired;      // the echo was not detected within echo_window_us
+	long long total_us;     // sum of latencies
+	long long max_us;       // worst latency
+	unsigned  hist[5];      // <1ms, <5ms, <20ms, <100ms, >=100ms
+};
+static EchoStats echo_stats = {};
+
+// Pump counters: syscalls and host calls made by the run() loop
+struct PumpStats
+{
+	unsigned long long selects;      // select() calls
+	unsigned long long reads;        // read() calls on pty
+	unsigned long long read_bytes;   // bytes received from pty
+	unsigned long long write_texts;  // Connector.WriteText calls
+};
+static PumpStats pump_stats = {};
+const int echo_max_len = 64;            // reads up to this size are treated as interactive echo
+const long long echo_window_us = 250000; // stop waiting for echo after this time
+const int echo_drain_max = 64*1024;     // max bulk bytes flushed in one loop iteration while echo is pending
+
+static void echo_input_written()
+{
+	if (!echo_stats.input_us)
+		echo_stats.input_us = get_time_us();
+}
+
+static bool echo_pending()
+{
+	if (!echo_stats.input_us)
+		return false;
+	if ((get_time_us() - echo_stats.input_us) > echo_window_us)
+	{
+		echo_stats.input_us = 0;
+		echo_stats.expired++;
+		return false;
+	}
+	return true;
+}
+
+// pty was drained after the input was written, so the echo must be delivered already
+static void echo_received()
+{
+	if (!echo_stats.input_us)
+		return;
+	long long latency = get_time_us() - echo_stats.input_us;
+	echo_stats.input_us = 0;
+	echo_stats.samples++;
+	echo_stats.total_us += latency;
+	if (latency > echo_stats.max_us)
+		echo_stats.max_us = latency;
+	const long long bounds[] = {1000, 5000, 20000, 100000};
+	int i = 0;
+	while (i < 4 && latency >= bounds[i])
+		++i;
+	echo_stats.hist[i]++;
+}
+
+static void log_track_modes(const char* buf, int len);
+
+static void log_output(const char *buf, int len)
+{
+	if (gnLogFileOut >= 0)
+	{
+		log_system_time(false);
+		write_log(gnLogFileOut, buf, len);
+		if (log_streams[1].idx_fd >= 0)
+			log_track_modes(buf, len);
+	}
+}
+
+static bool write_console(const char *buf, int len, WriteProcessedStream strm = wps_Output, bool log = true)
 {
 	if (len == -1)
 		len = strlen(buf);
@@ -380,14 +1073,14 @@ static bool write_console(const char *buf, int len, WriteProcessedStream strm =
 			// Server side, initialized
 
 			// First, log the string if required
-			if (gnLogFileOut >= 0)
-			{
-				log_system_time(false);
-				write(gnLogFileOut, buf, len);
-			}
+			if (log)
+				log_output(buf, len);
 
 			// Dump to console
+			long long trace_us = trace_begin();
 			bRc = Connector.WriteText(buf, len, &written, wps_Output);
+			trace_end("WriteText", trace_us, len);
+			pump_stats.write_texts++;
 		}
 		else if (pid != 0) // Not-a-child or before-fork
 		{
@@ -433,6 +1126,32 @@ static void write_verbose(const char *buf, ...)
 	write_console((ilen > 0) ? szBuf : buf, -1, wps_Error);
 }
 
+// Statistics are printed on exit with `--stats` or `--verbose` and stored in the log file
+static void write_stats(const char *buf, ...)
+{
+	char szBuf[1024];
+	va_list args;
+	va_start(args, buf);
+	int ilen = vsnprintf(szBuf, sizeof(szBuf) - 1, buf, args);
+	va_end(args);
+	if (ilen <= 0)
+		return;
+	if (ilen > (int)sizeof(szBuf) - 2)
+		ilen = sizeof(szBuf) - 2;
+
+	if (gnLogFileOut >= 0)
+	{
+		char log_stats[sizeof(szBuf) + 16];
+		int log_len = sprintf(log_stats, "\x1B]9;11;\"%s\"\x07\n", szBuf);
+		write_log(gnLogFileOut, log_stats, log_len);
+	}
+
+	if (verbose || show_stats)
+	{
+		write_verbose("\033[32;40m{PID:%u} %s\033[m\r\n", getpid(), szBuf);
+	}
+}
+
 void safe_close(int& f)
 {
 	if (f >= 0)
@@ -473,6 +1192,7 @@ void child_err_msg(const char* reason)
 static int resize_pty(int pty, struct winsize *winp)
 {
 	int iRc = -99;
+	long long trace_us = trace_begin();
 
 	if (pty >= 0)
 	{
@@ -494,7 +1214,7 @@ static int resize_pty(int pty, struct winsize *winp)
 			char szLogSize[80];
 			log_system_time(true);
 			sprintf(szLogSize, "\x1B]9;11;\"TIOCSWINSZ(%i,%i) %s\"\x07\n", winp->ws_col, winp->ws_row, (iRc == -1) ? "failed" : "succeeded");
-			write(gnLogFileOut, szLogSize, strlen(szLogSize));
+			write_log(gnLogFileOut, szLogSize, strlen(szLogSize));
 		}
 	}
 	else
@@ -502,9 +1222,22 @@ static int resize_pty(int pty, struct winsize *winp)
 		debug_log_format("resize_pty: invalid pty\n");
 	}
 
+	trace_end("resize_pty", trace_us, iRc);
 	return iRc;
 }
 
+// Full screen applications repaint themselves on SIGWINCH,
+// the size is changed twice to be sure the signal is raised
+static int nudge_pty_size(int pty, struct winsize *winp)
+{
+	struct winsize tmp = *winp;
+	tmp.ws_row = (winp->ws_row > 1) ? (winp->ws_row - 1) : (winp->ws_row + 1);
+	ioctl(pty, TIOCSWINSZ, &tmp);
+	return resize_pty(pty, winp);
+}
+
+static int term_columns = 80;  // last known width of the host console
+
 static bool query_console_size(struct winsize* winp)
 {
 	bool bRc = false;
@@ -514,6 +1247,7 @@ static bool query_console_size(struct winsize* winp)
 	{
 		winp->ws_row = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
 		winp->ws_col = csbi.dwSize.X;
+		term_columns = winp->ws_col;
 		bRc = true;
 	}
 	else
@@ -526,30 +1260,155 @@ static bool query_console_size(struct winsize* winp)
 	return bRc;
 }
 
-void write_input_buffered(char* data, int len)
+// Framed protocol between the session holder and its clients, see `--detach`:
+// frame type (1 byte), payload length (4 bytes, little-endian), payload
+enum SessFrameType
 {
-	const int buffer_max = 16;
-	static char buffer[buffer_max] = "";
-	static int buffer_used = 0;
-	char log_input[80];
-
-	if (data == NULL || len <= 0)
+	sf_Hello = 'H',  // client -> holder: protocol version (u32), session key
+	sf_Data  = 'D',  // pty input or output
+	sf_Size  = 'W',  // client -> holder: cols, rows, xpixel, ypixel (u16 each)
+	sf_Exit  = 'X',  // holder -> client: waitpid status of the shell (u32)
+	sf_Error = 'E',  // holder -> client: the client was refused, reason text
+};
+#define SESS_PROTOCOL 2
+#define SESS_HEADER 5
+#define SESS_FRAME_MAX (64*1024)
+struct SessionLink
+{
+	int fd;
+	int pos, used;  // parsed and received bytes of buf
+	char buf[SESS_HEADER + SESS_FRAME_MAX];
+};
+// Client side: link to the holder, it's used instead of pty_fd
+static SessionLink session_link = {-1};
+
+static bool write_all(int fd, const char* data, int len)
+{
+	while (len > 0)
 	{
-		if (buffer_used > 0)
-		{
-			ssize_t written = write(pty_fd, buffer, buffer_used);
-
-			if (gnLogFileIn >= 0)
-			{
-				sprintf(log_input, " written %i of %i bytes\n", written, buffer_used);
-				write(gnLogFileIn, log_input, strlen(log_input));
-			}
-		}
-		buffer_used = 0;
-		return;
+		ssize_t written = write(fd, data, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written; len -= written;
 	}
+	return true;
+}
 
-	for (int i = 0; i < len; ++i)
+static bool sess_send(int fd, char type, const void* data, int len)
+{
+	const char* p = (const char*)data;
+	do {
+		int part = (len > SESS_FRAME_MAX) ? SESS_FRAME_MAX : len;
+		char frame[SESS_HEADER + 4096];
+		frame[0] = type;
+		lz4_write32((unsigned char*)frame + 1, part);
+		if (part <= 4096)
+		{
+			memcpy(frame + SESS_HEADER, p, part);
+			if (!write_all(fd, frame, SESS_HEADER + part))
+				return false;
+		}
+		else if (!write_all(fd, frame, SESS_HEADER) || !write_all(fd, p, part))
+		{
+			return false;
+		}
+		p += part; len -= part;
+	} while (len > 0);
+	return true;
+}
+
+static bool sess_send_size(int fd, const struct winsize* winp)
+{
+	unsigned char size[8];
+	const unsigned short values[4] = {winp->ws_col, winp->ws_row, winp->ws_xpixel, winp->ws_ypixel};
+	for (int i = 0; i < 4; ++i)
+	{
+		size[i*2] = (unsigned char)values[i];
+		size[i*2+1] = (unsigned char)(values[i] >> 8);
+	}
+	return sess_send(fd, sf_Size, size, sizeof(size));
+}
+
+static void sess_get_size(const char* data, int len, struct winsize* winp)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	memset(winp, 0, sizeof(*winp));
+	if (len < 8)
+		return;
+	winp->ws_col = p[0] | (p[1] << 8);
+	winp->ws_row = p[2] | (p[3] << 8);
+	winp->ws_xpixel = p[4] | (p[5] << 8);
+	winp->ws_ypixel = p[6] | (p[7] << 8);
+}
+
+// Returns the read() result
+static int sess_fill(SessionLink& sl)
+{
+	if (sl.pos > 0)
+	{
+		memmove(sl.buf, sl.buf + sl.pos, sl.used - sl.pos);
+		sl.used -= sl.pos;
+		sl.pos = 0;
+	}
+	int len = read(sl.fd, sl.buf + sl.used, sizeof(sl.buf) - sl.used);
+	if (len > 0)
+		sl.used += len;
+	return len;
+}
+
+// Returns 1 if the complete frame is in the buffer, 0 if more data is required, -1 on protocol error
+static int sess_next(SessionLink& sl, char& type, const char*& data, int& len)
+{
+	if (sl.used - sl.pos < SESS_HEADER)
+		return 0;
+	unsigned size = lz4_read32((const unsigned char*)sl.buf + sl.pos + 1);
+	if (size > SESS_FRAME_MAX)
+		return -1;
+	if ((unsigned)(sl.used - sl.pos - SESS_HEADER) < size)
+		return 0;
+	type = sl.buf[sl.pos];
+	data = sl.buf + sl.pos + SESS_HEADER;
+	len = size;
+	sl.pos += SESS_HEADER + size;
+	return 1;
+}
+
+// Input is written into the pty or passed to the session holder
+static ssize_t write_pty(const char* data, int len)
+{
+	if (session_link.fd >= 0)
+		return sess_send(session_link.fd, sf_Data, data, len) ? len : -1;
+	return write(pty_fd, data, len);
+}
+
+void write_input_buffered(char* data, int len)
+{
+	const int buffer_max = 16;
+	static char buffer[buffer_max] = "";
+	static int buffer_used = 0;
+	char log_input[80];
+
+	if (data == NULL || len <= 0)
+	{
+		if (buffer_used > 0)
+		{
+			ssize_t written = write_pty(buffer, buffer_used);
+			if (written > 0)
+				echo_input_written();
+
+			if (gnLogFileIn >= 0)
+			{
+				sprintf(log_input, " written %i of %i bytes\n", written, buffer_used);
+				write_log(gnLogFileIn, log_input, strlen(log_input));
+			}
+		}
+		buffer_used = 0;
+		return;
+	}
+
+	for (int i = 0; i < len; ++i)
 	{
 		if (data[i] == 27 || buffer_used == buffer_max)
 		{
@@ -560,7 +1419,7 @@ void write_input_buffered(char* data, int len)
 	}
 
 	sprintf(log_input, " buffered, total %i bytes\n", buffer_used);
-	write(gnLogFileIn, log_input, strlen(log_input));
+	write_log(gnLogFileIn, log_input, strlen(log_input));
 }
 
 // returns true on more events in queue
@@ -574,7 +1433,9 @@ bool read_input()
 		DWORD nReady = 0;
 		const DWORD buffer_max = 32;
 		INPUT_RECORD rr[buffer_max] = {};
+		long long trace_us = trace_begin();
 		ReadInputResult read_rc = Connector.ReadInput(rr, buffer_max, &nReady);
+		trace_end("ReadInput", trace_us, nReady);
 		if (!read_rc || !nReady)
 			return false;
 		has_more_data = (read_rc == rir_Ready_More);
@@ -590,7 +1451,7 @@ bool read_input()
 				if (gnLogFileIn >= 0)
 				{
 					sprintf(log_input, "input: WindowBufferSize (%i,%i)\n", r.Event.WindowBufferSizeEvent.dwSize.X, r.Event.WindowBufferSizeEvent.dwSize.Y);
-					write(gnLogFileIn, log_input, strlen(log_input));
+					write_log(gnLogFileIn, log_input, strlen(log_input));
 				}
 
 				if (query_console_size(&winp))
@@ -599,10 +1460,12 @@ bool read_input()
 
 					if (pty_fd >= 0)
 						resize_pty(pty_fd, &winp);
+					else if (session_link.fd >= 0)
+						sess_send_size(session_link.fd, &winp);
 					else if (gnLogFileIn >= 0)
 					{
 						const char* invalid_pty = "input: invalid pty_fd\n";
-						write(gnLogFileIn, invalid_pty, strlen(invalid_pty));
+						write_log(gnLogFileIn, invalid_pty, strlen(invalid_pty));
 					}
 
 					if (pty_err >= 0)
@@ -611,7 +1474,7 @@ bool read_input()
 				else
 				{
 					const char* query_console_size_failed = "input: query_console_size failed!!!\n";
-					write(gnLogFileIn, query_console_size_failed, strlen(query_console_size_failed));
+					write_log(gnLogFileIn, query_console_size_failed, strlen(query_console_size_failed));
 				}
 				break;
 			} // WINDOW_BUFFER_SIZE_EVENT
@@ -623,7 +1486,7 @@ bool read_input()
 					if (gnLogFileIn >= 0)
 					{
 						sprintf(log_input, "input: KeyUp=%u skipped\n", r.Event.KeyEvent.wVirtualKeyCode);
-						write(gnLogFileIn, log_input, strlen(log_input));
+						write_log(gnLogFileIn, log_input, strlen(log_input));
 					}
 					break;
 				}
@@ -638,12 +1501,13 @@ bool read_input()
 						if (gnLogFileIn >= 0)
 						{
 							sprintf(log_input, "input: `\\x00` ");
-							write(gnLogFileIn, log_input, strlen(log_input));
+							write_log(gnLogFileIn, log_input, strlen(log_input));
 						}
 
 						// #TODO: Alt/Shift combo?
 
 						write_input_buffered(&zero, len);
+						predict_key(&zero, len);
 
 						break;
 					}
@@ -659,10 +1523,16 @@ bool read_input()
 						if (gnLogFileIn >= 0)
 						{
 							sprintf(log_input, "input: `%s` ", s);
-							write(gnLogFileIn, log_input, strlen(log_input));
+							write_log(gnLogFileIn, log_input, strlen(log_input));
 						}
 
 						write_input_buffered(s, len);
+						query_input(s, len);
+						// Alt+Key may be sent as ESC prefix by the terminal, don't predict it
+						if (r.Event.KeyEvent.dwControlKeyState & (LEFT_ALT_PRESSED|RIGHT_ALT_PRESSED))
+							predict_key("\033", 1);
+						else
+							predict_key(s, len);
 					}
 				}
 				break;
@@ -672,7 +1542,7 @@ bool read_input()
 				if (gnLogFileIn >= 0)
 				{
 					sprintf(log_input, "input: event %u received\n", r.EventType);
-					write(gnLogFileIn, log_input, strlen(log_input));
+					write_log(gnLogFileIn, log_input, strlen(log_input));
 				}
 			} // switch (r.EventType)
 		} // if (Connector.ReadInput
@@ -700,180 +1570,5894 @@ static void stop_threads()
 	StopTermConnector();
 }
 
-static int process_pty(int& pty, char* buf, const int bufCount, const int preferredCount)
+// Streaming tokenizer of the pty output.
+// Text runs and escape sequences are returned as spans of the read buffer,
+// only sequences split between reads are copied into the scanner buffer.
+enum VtTokenType
 {
-	debug_log_format("%u:PID=%u:TID=%u: calling read(%i)\n", GetTickCount(), getpid(), GetCurrentThreadId(), pty);
-	int len = read(pty, buf, bufCount);
+	vt_Text,    // printable text and control characters
+	vt_Esc,     // ESC + intermediates + final, e.g. "\0337" or "\033(B"
+	vt_CSI,     // ESC [ params intermediates final
+	vt_OSC,     // ESC ] ... BEL or ST
+	vt_DCS,     // ESC P ... ST
+	vt_Str,     // other strings: SOS, PM, APC
+	vt_Raw,     // part of too long or unfinished sequence, passed as is
+};
+struct VtToken
+{
+	VtTokenType type;
+	const char* ptr;
+	int len;
+};
+enum VtState
+{
+	vs_Ground, vs_Esc, vs_Csi, vs_Str, vs_StrEsc,
+};
+#define VT_SEQ_MAX 4096
+struct VtScanner
+{
+	VtState state;
+	VtTokenType seq_type;
+	int seq_len;              // bytes of the unfinished sequence in `seq`
+	bool raw;                 // sequence was too long, its tail is passed as vt_Raw
+	bool esc_carry;           // ESC which cancelled the string at the end of previous read starts the next sequence
+	long long raw_len;        // bytes of too long sequence passed so far
+	// Returned token may point into `seq` until the end of the read, the next
+	// unfinished sequence of the same read is collected in the other buffer
+	int seq_buf;
+	char seq[2][VT_SEQ_MAX];
+};
+
+// Token is returned from the scanner buffer, switch to the other one
+static const char* vt_take_seq(VtScanner& vs)
+{
+	const char* ptr = vs.seq[vs.seq_buf];
+	vs.seq_buf ^= 1;
+	vs.seq_len = 0;
+	return ptr;
+}
 
-	if (len > 0)
+static VtTokenType vt_string_type(char c)
+{
+	return (c == ']') ? vt_OSC : (c == 'P') ? vt_DCS : vt_Str;
+}
+
+// Returns false when `p` reached `end`, the unfinished sequence is kept in the scanner
+static bool vt_next(VtScanner& vs, const char*& p, const char* end, VtToken& tok)
+{
+	const char* start = p;
+	if (vs.state == vs_Ground)
 	{
-		while ((len+4) < preferredCount)
+		if (p >= end)
+			return false;
+		if (*p != 27 && !vs.esc_carry)
 		{
-			int addLen = read(pty, buf+len, bufCount-len);
-			if (addLen <= 0)
-				break;
-			len += addLen;
+			const char* esc = (const char*)memchr(p, 27, end - p);
+			p = esc ? esc : end;
+			tok.type = vt_Text; tok.ptr = start; tok.len = p - start;
+			return true;
+		}
+		vs.state = vs_Esc;
+		vs.seq_type = vt_Esc;
+		vs.seq_len = 0;
+		vs.raw = false;
+		vs.raw_len = 0;
+		if (vs.esc_carry)
+		{
+			vs.esc_carry = false;
+			vs.seq[vs.seq_buf][0] = 27;
+			vs.seq_len = 1;
+		}
+		else
+		{
+			++p;
 		}
-		buf[len] = 0;
-		write_console(buf, len, (pty == pty_err) ? wps_Error : wps_Output);
 	}
-	else
+
+	bool done = false;
+	while (p < end && !done)
 	{
-		if (verbose)
+		char c = *(p++);
+		switch (vs.state)
 		{
-			write_verbose("\r\n\033[31;40m{PID:%u} read(pty=%i) failed (len=%i,errno=%i): %s\033[m\r\n", getpid(), pty, len, errno, strerror(errno));
-			check_child();
+		case vs_Esc:
+			if (c == '[')
+				{ vs.state = vs_Csi; vs.seq_type = vt_CSI; }
+			else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+				{ vs.state = vs_Str; vs.seq_type = vt_string_type(c); }
+			else if (c == 27)
+				{ --p; done = true; } // next sequence is started
+			else if (c < 0x20 || c > 0x2F)
+				done = true; // final byte, intermediates 0x20..0x2F continue the sequence
+			break;
+		case vs_Csi:
+			if (c >= 0x40 && c <= 0x7E)
+				done = true;
+			else if (c == 0x18 || c == 0x1A)
+				done = true; // CAN/SUB abort the sequence
+			else if (c == 27)
+				{ --p; done = true; }
+			break;
+		case vs_Str:
+			if (c == 7 && vs.seq_type == vt_OSC)
+				done = true;
+			else if (c == 27)
+				vs.state = vs_StrEsc;
+			break;
+		case vs_StrEsc:
+			if (c == '\\')
+			{
+				done = true;
+			}
+			else if (p - 2 >= start)
+			{
+				// ESC without '\' cancels the string and starts the next sequence
+				p -= 2;
+				done = true;
+			}
+			else
+			{
+				// the same, but the ESC was at the end of previous read
+				--p;
+				done = true;
+				vs.esc_carry = true;
+				if (!vs.raw && vs.seq_len)
+					vs.seq_len--;
+			}
+			break;
+		default:
+			done = true;
 		}
-		pty = -1;
 	}
 
-	return len;
+	int part = p - start;
+	if (vs.raw)
+	{
+		// tail of too long sequence
+		tok.type = vt_Raw; tok.ptr = start; tok.len = part;
+		vs.raw_len += part;
+		if (done)
+			vs.state = vs_Ground;
+		if (!part && done)
+			return vt_next(vs, p, end, tok); // the string was cancelled by ESC from previous read
+		return part > 0;
+	}
+
+	if (done && !vs.seq_len)
+	{
+		// the whole sequence is in the current buffer
+		vs.state = vs_Ground;
+		tok.type = vs.seq_type; tok.ptr = start; tok.len = part;
+		return true;
+	}
+
+	if (vs.seq_len + part > VT_SEQ_MAX)
+	{
+		// don't buffer huge strings (sixel, images), pass them through
+		vs.raw = true;
+		if (vs.seq_len)
+		{
+			// return the buffered head now, the rest is returned on the next call
+			p = start;
+			tok.type = vt_Raw; tok.len = vs.seq_len; tok.ptr = vt_take_seq(vs);
+			vs.raw_len = tok.len;
+			return true;
+		}
+		tok.type = vt_Raw; tok.ptr = start; tok.len = part;
+		vs.raw_len = part;
+		if (done)
+			vs.state = vs_Ground;
+		return true;
+	}
+
+	memcpy(vs.seq[vs.seq_buf] + vs.seq_len, start, part);
+	vs.seq_len += part;
+	if (!done)
+		return false;
+
+	vs.state = vs_Ground;
+	tok.type = vs.seq_type; tok.len = vs.seq_len; tok.ptr = vt_take_seq(vs);
+	return true;
 }
 
-static int check_child(bool force_print /*= false*/)
+// Unfinished sequence is returned as is, e.g. when there was no output for a while
+static bool vt_flush(VtScanner& vs, VtToken& tok)
 {
-	if (pid <= 0)
-		return -1;
+	if (vs.esc_carry)
+	{
+		vs.esc_carry = false;
+		tok.type = vt_Raw; tok.ptr = "\033"; tok.len = 1;
+		return true;
+	}
+	if (vs.state == vs_Ground || !vs.seq_len)
+		return false;
+	tok.type = vt_Raw; tok.len = vs.seq_len; tok.ptr = vt_take_seq(vs);
+	vs.state = vs_Ground;
+	return true;
+}
 
-	int status = 0, wait_rc;
+// Parse numeric parameters of CSI sequence, returns the count
+// prefix receives private marker ('?', '>', ...) or 0.
+// Sub-parameters (after ':') are skipped, or returned when `sub` is given,
+// then its bit N is set if params[N] is a sub-parameter.
+static int vt_csi_params(const VtToken& tok, char& prefix, int* params, int max_params, char& final, unsigned* sub = NULL)
+{
+	const char* p = tok.ptr + 2;
+	const char* end = tok.ptr + tok.len - 1;
+	int count = 0;
+	final = tok.ptr[tok.len - 1];
+	prefix = (p < end && *p >= '<' && *p <= '?') ? *(p++) : 0;
+	if (p >= end || (!isdigit(*p) && *p != ';' && *p != ':'))
+		return 0;
+	int value = 0;
+	bool has_value = false, is_sub = false;
+	if (sub)
+		*sub = 0;
+	for (; p <= end && count < max_params; ++p)
+	{
+		if (p < end && isdigit(*p))
+		{
+			value = value * 10 + (*p - '0');
+			has_value = true;
+		}
+		else if (p == end || *p == ';' || *p == ':')
+		{
+			if (!is_sub)
+				params[count++] = has_value ? value : 0;
+			else if (sub)
+			{
+				if (count < 32)
+					*sub |= 1U << count;
+				params[count++] = has_value ? value : 0;
+			}
+			value = 0; has_value = false;
+			if (p == end)
+				break;
+			is_sub = (*p == ':');
+		}
+		else
+		{
+			// intermediates
+			if (!is_sub || sub)
+			{
+				if (is_sub && count < 32)
+					*sub |= 1U << count;
+				params[count++] = has_value ? value : 0;
+			}
+			break;
+		}
+	}
+	return count;
+}
 
-	debug_log_format("%u:PID=%u:TID=%u: calling waitpid(%i)\n", GetTickCount(), getpid(), GetCurrentThreadId(), pid);
-	wait_rc = waitpid(pid, &status, WNOHANG);
-	debug_log_format("%u:PID=%u:TID=%u: waitpid(%i) done rc=%u status=0x%X\n", GetTickCount(), getpid(), GetCurrentThreadId(), pid, wait_rc, status);
+// Intermediate byte of CSI sequence (e.g. '$' in DECRQM), or 0
+static char vt_csi_intermediate(const VtToken& tok)
+{
+	char c = (tok.len > 3) ? tok.ptr[tok.len - 2] : 0;
+	return (c >= 0x20 && c <= 0x2F) ? c : 0;
+}
 
-	if (wait_rc == pid)
+// Answers are sent to the shell as if they were typed by user
+static void reply_to_pty(const char* reply, int len)
+{
+	if (pty_fd < 0 && session_link.fd < 0)
+		return;
+	write_input_buffered(NULL, 0);
+	write_pty(reply, len);
+	if (gnLogFileIn >= 0)
+	{
+		char log_reply[80];
+		sprintf(log_reply, "reply: %i bytes\n", len);
+		write_log(gnLogFileIn, log_reply, strlen(log_reply));
+	}
+}
+
+// Output spans are passed to the host without copying;
+// contiguous spans are merged into single WriteText call
+static const char* out_span = NULL;
+static int out_span_len = 0;
+static WriteProcessedStream out_stream = wps_Output;
+
+// Spans which are not contiguous are gathered here, so the host
+// still receives one WriteText call per read
+static char* out_gather = NULL;
+static int out_gather_size = 0;
+const int out_gather_max = 64*1024;
+// Sequences generated by output stages, valid until out_flush
+static char out_scratch[4096];
+static int out_scratch_used = 0;
+
+static void out_flush()
+{
+	if (out_span_len > 0)
+		write_console(out_span, out_span_len, out_stream);
+	out_span = NULL;
+	out_span_len = 0;
+	out_scratch_used = 0;
+}
+
+// Synchronized output (DEC private mode 2026).
+// The frame between `CSI ? 2026 h` and `CSI ? 2026 l` is passed to the host in one call.
+struct SyncOutput
+{
+	bool enabled;          // `--no-sync-output` disables it
+	bool mode;             // application has set the mode
+	bool holding;          // the frame is collected in `data`
+	long long since_us;    // when the frame was started
+	char* data;
+	int len, size;
+	unsigned frames, timeouts, overflows;
+};
+static SyncOutput sync_output = {true};
+const int sync_max_size = 4*1024*1024;     // the frame is passed as is when exceeds this size
+const long long sync_timeout_us = 150000;  // or when the application does not finish it in time
+
+static void sync_flush()
+{
+	if (sync_output.holding && sync_output.len > 0)
+		write_console(sync_output.data, sync_output.len, out_stream);
+	sync_output.len = 0;
+	sync_output.holding = false;
+}
+
+static void out_emit(const char* ptr, int len)
+{
+	if (len <= 0)
+		return;
+	if (sync_output.holding)
 	{
-		if (verbose || force_print)
+		if (sync_output.len + len > sync_output.size && sync_output.size < sync_max_size)
 		{
-			if (WIFEXITED(status))
-				write_verbose("\r\n\033[31;40m{PID:%u} pid=%i was terminated, exitcode=%u", getpid(), pid, WEXITSTATUS(status), strerror(WEXITSTATUS(status)));
-			else if (WIFSIGNALED(status))
-				write_verbose("\r\n\033[31;40m{PID:%u} pid=%i was terminated by signal (%u): %s", getpid(), pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
-			else
-				write_verbose("\r\n\033[31;40m{PID:%u} pid=%i was terminated, status=%i\033[m\r\n", getpid(), pid, status);
+			int new_size = _max(sync_output.size * 2, 64 * 1024);
+			while (new_size < sync_output.len + len && new_size < sync_max_size)
+				new_size *= 2;
+			char* new_data = (char*)realloc(sync_output.data, new_size);
+			if (new_data)
+			{
+				sync_output.data = new_data;
+				sync_output.size = new_size;
+			}
+		}
+		if (sync_output.len + len <= sync_output.size)
+		{
+			memcpy(sync_output.data + sync_output.len, ptr, len);
+			sync_output.len += len;
+			return;
 		}
+		// too large frame, don't delay it anymore
+		sync_output.overflows++;
+		sync_flush();
+	}
 
-		pid = -2;
+	if (out_span && (out_span + out_span_len == ptr))
+	{
+		out_span_len += len;
+		return;
 	}
-	else if (wait_rc == 0)
+	if (out_span && (out_span_len + len <= out_gather_max))
 	{
-		// One or more child(ren) exist
-		if (force_print)
+		if (out_span_len + len > out_gather_size)
 		{
-			write_verbose("\r\n\033[31;40m{PID:%u} one or more children with pid=%i are alive\033[m\r\n", getpid(), pid);
+			char* new_gather = (char*)realloc(out_gather, out_gather_max);
+			if (new_gather)
+			{
+				if (out_span == out_gather)
+					out_span = new_gather;
+				out_gather = new_gather;
+				out_gather_size = out_gather_max;
+			}
+		}
+		if (out_span_len + len <= out_gather_size)
+		{
+			if (out_span != out_gather)
+			{
+				memmove(out_gather, out_span, out_span_len);
+				out_span = out_gather;
+			}
+			memcpy(out_gather + out_span_len, ptr, len);
+			out_span_len += len;
+			return;
 		}
 	}
-	else if (verbose || force_print)
+	out_flush();
+	out_span = ptr;
+	out_span_len = len;
+	// the span was just copied into out_scratch, keep it
+	if (ptr >= out_scratch && ptr < out_scratch + sizeof(out_scratch))
+		out_scratch_used = (int)(ptr + len - out_scratch);
+}
+
+// Output filter chain. Every stage gets the tokens (spans of the read buffer,
+// never copied) and returns true when it consumed the token, otherwise the
+// token goes to the next stage. To replace or hold a token the stage consumes it
+// and passes spans later with filter_emit(). The last stage is out_emit().
+// Built-in stages go in OutputFilterId order, `--filter` plugins follow them.
+enum OutputFilterId
+{
+	of_Modes,       // tracks DEC private modes, never consumes
+	of_Query,       // answers terminal queries locally
+	of_Trigger,     // notifications on matched output
+	of_Command,     // command timing by OSC 133 marks
+	of_Background,  // keeps the output of hidden tab off the host
+	of_Progress,    // squashes progress bar redraws
+	of_Sgr,         // minimizes SGR sequences
+	of_Cwd,         // reports the shell cwd to the host
+	of_Sync,        // synchronized output frames
+	of_Builtin,
+};
+static void filter_pass(int stage, const VtToken& tok);
+
+// The current read from pty, its spans are valid until out_flush
+static const char* out_batch_begin = NULL;
+static const char* out_batch_end = NULL;
+
+// Pass the span to stages following `stage`
+static void filter_emit(int stage, VtTokenType type, const char* ptr, int len)
+{
+	VtToken tok = {type, ptr, len};
+	filter_pass(stage + 1, tok);
+}
+
+// The same for sequences generated by the stage, they are copied into out_scratch
+static void filter_emit_copy(int stage, VtTokenType type, const char* ptr, int len)
+{
+	if (len > (int)sizeof(out_scratch))
 	{
-		write_verbose("\r\n\033[31;40m{PID:%u} waitpid(%i) failed (%i): %s", getpid(), pid, errno, strerror(errno));
+		// can't be kept, pass it to the host at once
+		out_flush();
+		filter_emit(stage, type, ptr, len);
+		out_flush();
+		return;
 	}
+	if (out_scratch_used + len > (int)sizeof(out_scratch))
+		out_flush();
+	char* dst = out_scratch + out_scratch_used;
+	memcpy(dst, ptr, len);
+	out_scratch_used += len;
+	filter_emit(stage, type, dst, len);
+}
 
-	return (pid <= 0) ? -1 : 0;
+static void sync_check_timeout()
+{
+	if (sync_output.holding && (get_time_us() - sync_output.since_us) > sync_timeout_us)
+	{
+		sync_output.timeouts++;
+		sync_flush();
+	}
 }
 
-static int run()
+// returns true if the token was consumed
+static bool sync_process(const VtToken& tok)
 {
-	fd_set fds;
-	const int preferredCount = 280;
-	const int bufCount = 4096;
-	char buf[bufCount+1];
+	if (!sync_output.enabled || tok.type != vt_CSI || tok.len < 8 || tok.ptr[2] != '?')
+		return false;
 
-	for (;;)
+	char prefix, final;
+	int params[16];
+	int count = vt_csi_params(tok, prefix, params, 16, final);
+	char intermediate = vt_csi_intermediate(tok);
+
+	if (final == 'p' && intermediate == '$' && count == 1 && params[0] == 2026)
 	{
-		struct timeval timeout = {0, 100000};
+		// DECRQM, Ps: 1 - set, 2 - reset
+		char reply[32];
+		int len = sprintf(reply, "\033[?2026;%i$y", sync_output.mode ? 1 : 2);
+		reply_to_pty(reply, len);
+		return true;
+	}
 
-		FD_ZERO(&fds);
-		if (pty_fd >= 0)
+	if ((final != 'h' && final != 'l') || intermediate)
+		return false;
+	bool found = false;
+	for (int i = 0; i < count; ++i)
+		if (params[i] == 2026)
+			found = true;
+	if (!found)
+		return false;
+
+	if (final == 'h')
+	{
+		sync_output.mode = true;
+		if (!sync_output.holding)
 		{
-			FD_SET(pty_fd, &fds);
-			if (pty_err >= 0)
-				FD_SET(pty_err, &fds);
+			out_flush();
+			sync_output.holding = true;
+			sync_output.since_us = get_time_us();
+		}
+		filter_emit(of_Sync, tok.type, tok.ptr, tok.len);
+	}
+	else
+	{
+		sync_output.mode = false;
+		filter_emit(of_Sync, tok.type, tok.ptr, tok.len);
+		if (sync_output.holding)
+			sync_output.frames++;
+		sync_flush();
+	}
+	return true;
+}
+
+// Bit of DEC private mode in term_modes, 0 if the mode is not tracked
+static unsigned term_mode_bit(int mode)
+{
+	switch (mode)
+	{
+	case 1:    return tm_CursorKeys;
+	case 6:    return tm_Origin;
+	case 7:    return tm_AutoWrap;
+	case 25:   return tm_CursorShow;
+	case 47: case 1047: case 1049: return tm_AltScreen;
+	case 1000: return tm_MouseX10;
+	case 1002: return tm_MouseButton;
+	case 1003: return tm_MouseAny;
+	case 1006: return tm_MouseSgr;
+	case 2004: return tm_BracketPaste;
+	case 2026: return tm_SyncOutput;
+	}
+	return 0;
+}
+
+// DECSET/DECRST of the tracked modes
+static void modes_apply(const VtToken& tok, unsigned& modes)
+{
+	if (tok.type != vt_CSI || tok.len < 5 || tok.ptr[2] != '?')
+		return;
+	char last = tok.ptr[tok.len - 1];
+	if ((last != 'h' && last != 'l') || vt_csi_intermediate(tok))
+		return;
+
+	char prefix, final;
+	int params[16];
+	int count = vt_csi_params(tok, prefix, params, 16, final);
+	for (int i = 0; i < count; ++i)
+	{
+		unsigned bit = term_mode_bit(params[i]);
+		if (final == 'h')
+			modes |= bit;
+		else
+			modes &= ~bit;
+	}
+}
+
+static void replay_track_pen(const VtToken& tok);
+
+// Track DEC private modes set/reset by the application, the token is never consumed
+static bool modes_process(const VtToken& tok)
+{
+	modes_apply(tok, term_modes);
+	replay_track_pen(tok);
+	return false;
+}
+
+// The logged output is scanned separately for keyframes of the out-log index
+static VtScanner log_scanner = {};
+static void log_track_modes(const char* buf, int len)
+{
+	const char* p = buf;
+	const char* end = buf + len;
+	VtToken tok;
+	while (vt_next(log_scanner, p, end, tok))
+		modes_apply(tok, log_modes);
+	log_mid_token = (log_scanner.state != vs_Ground) || log_scanner.esc_carry;
+}
+
+// Sequence to restore the tracked modes, synchronized output is never restored
+static int format_term_modes(char* buf, unsigned modes)
+{
+	const struct { int mode; unsigned bit; } list[] = {
+		{1, tm_CursorKeys}, {6, tm_Origin}, {7, tm_AutoWrap}, {25, tm_CursorShow}, {1049, tm_AltScreen},
+		{1000, tm_MouseX10}, {1002, tm_MouseButton}, {1003, tm_MouseAny}, {1006, tm_MouseSgr}, {2004, tm_BracketPaste},
+	};
+	int len = 0;
+	for (size_t i = 0; i < sizeof(list)/sizeof(list[0]); ++i)
+		len += sprintf(buf + len, "\033[?%i%c", list[i].mode, (modes & list[i].bit) ? 'h' : 'l');
+	return len;
+}
+
+// Working directory is reported by the shell with OSC 7 ("file://host/path")
+// or with ConEmu's OSC 9;9 ("path"). The host is informed with OSC 9;9 in Windows
+// form only when the directory was changed, POSIX paths are converted through LRU cache.
+struct CwdTracker
+{
+	bool enabled;      // `--no-cwd` passes the reports as is
+	char* last;        // last directory passed to the host, Windows path
+	unsigned reports, changes, conversions, cache_hits;
+};
+static CwdTracker cwd_tracker = {true};
+#define CWD_CACHE_SIZE 16
+struct CwdCacheItem
+{
+	char* posix;
+	char* win;
+	unsigned used;     // cwd_cache_tick of the last lookup
+};
+static CwdCacheItem cwd_cache[CWD_CACHE_SIZE] = {};
+static unsigned cwd_cache_tick = 0;
+
+static const char* cwd_to_windows(const char* posix)
+{
+	int lru = 0;
+	for (int i = 0; i < CWD_CACHE_SIZE; ++i)
+	{
+		if (cwd_cache[i].posix && strcmp(cwd_cache[i].posix, posix) == 0)
+		{
+			cwd_cache[i].used = ++cwd_cache_tick;
+			cwd_tracker.cache_hits++;
+			return cwd_cache[i].win;
 		}
-		else if (pid > 0)
+		if (cwd_cache[i].used < cwd_cache[lru].used)
+			lru = i;
+	}
+
+	char* win = NULL;
+	#if defined(HAS_FORKPTY)
+	ssize_t cvtlen = cygwin_conv_path(CCP_POSIX_TO_WIN_A, posix, NULL, 0);
+	if (cvtlen > 0 && (win = (char*)malloc(cvtlen)) != NULL
+		&& cygwin_conv_path(CCP_POSIX_TO_WIN_A, posix, win, cvtlen) != 0)
+	{
+		free(win);
+		win = NULL;
+	}
+	#else
+	//MSYS1 has only deprecated cygwin_conv_to_full_win32_path
+	win = (char*)malloc(MAX_PATH);
+	if (win && cygwin_conv_to_full_win32_path(posix, win) != 0)
+	{
+		free(win);
+		win = NULL;
+	}
+	#endif
+	if (!win)
+		return NULL;
+
+	cwd_tracker.conversions++;
+	free(cwd_cache[lru].posix);
+	free(cwd_cache[lru].win);
+	cwd_cache[lru].posix = strdup(posix);
+	cwd_cache[lru].win = win;
+	cwd_cache[lru].used = ++cwd_cache_tick;
+	return win;
+}
+
+// OSC 7 of ssh sessions or containers names directories of other hosts
+static bool cwd_local_host(const char* host, int len)
+{
+	static char local[256] = "";
+	if (!len || (len == 9 && strncasecmp(host, "localhost", 9) == 0))
+		return true;
+	if (!*local && gethostname(local, sizeof(local) - 1) != 0)
+		return false;
+	// "box" reported by the shell and "box.example.com" by gethostname, or vice versa
+	int local_len = strlen(local);
+	int cmp_len = _min(len, local_len);
+	if (strncasecmp(host, local, cmp_len) != 0)
+		return false;
+	return (len == local_len) || (len > local_len && host[local_len] == '.')
+		|| (local_len > len && local[len] == '.');
+}
+
+static bool cwd_process(const VtToken& tok)
+{
+	if (!cwd_tracker.enabled || tok.type != vt_OSC || tok.len < 6)
+		return false;
+
+	const char* p = tok.ptr + 2;
+	const char* end = tok.ptr + tok.len - ((tok.ptr[tok.len - 1] == 7) ? 1 : 2);
+	char path[1024];
+	int len = 0;
+	if (end - p > 2 && p[0] == '7' && p[1] == ';')
+	{
+		// file://host/path, percent-encoded
+		p += 2;
+		if (end - p >= 7 && memcmp(p, "file://", 7) == 0)
+		{
+			p += 7;
+			const char* host = p;
+			while (p < end && *p != '/')
+				++p;
+			if (!cwd_local_host(host, p - host))
+				return false; // not our file system, pass it as is
+		}
+		for (; p < end && len < (int)sizeof(path) - 1; ++p)
+		{
+			if (*p == '%' && end - p >= 3 && isxdigit(p[1]) && isxdigit(p[2]))
+			{
+				char hex[3] = {p[1], p[2], 0};
+				path[len++] = (char)strtol(hex, NULL, 16);
+				p += 2;
+			}
+			else
+			{
+				path[len++] = *p;
+			}
+		}
+	}
+	else if (end - p > 4 && memcmp(p, "9;9;", 4) == 0)
+	{
+		p += 4;
+		if (end - p >= 2 && *p == '"' && end[-1] == '"')
+		{
+			++p; --end;
+		}
+		len = _min((int)(end - p), (int)sizeof(path) - 1);
+		memcpy(path, p, len);
+	}
+	else
+	{
+		return false;
+	}
+	path[len] = 0;
+	if (!len)
+		return false;
+
+	cwd_tracker.reports++;
+	const char* win = (path[0] == '/') ? cwd_to_windows(path) : path;
+	if (!win)
+		return false;
+	// OSC 7 and OSC 9;9 spellings of one directory give the same Windows path
+	if (cwd_tracker.last && strcmp(cwd_tracker.last, win) == 0)
+		return true; // the host already knows it
+	free(cwd_tracker.last);
+	cwd_tracker.last = strdup(win);
+	cwd_tracker.changes++;
+
+	char report[sizeof(path) + MAX_PATH + 16];
+	int report_len = snprintf(report, sizeof(report), "\033]9;9;\"%s\"\033\\", win);
+	if (report_len > 0 && report_len < (int)sizeof(report))
+		filter_emit_copy(of_Cwd, vt_OSC, report, report_len);
+	return true;
+}
+
+// Streaming SGR minimizer (`--sgr-minimize`). Attributes set by the application
+// are collected in `pending` and passed to the host right before the next non-SGR
+// token, as the shortest sequence turning `emitted` rendition into `pending` one.
+// Sequences with unknown parameters are passed as is, and minimization
+// is suspended until the rendition is reset. Cursor save/restore (DECSC/DECRC,
+// SCOSC/SCORC, ?1048, ?1049) and resets (RIS, DECSTR) change the host rendition too.
+enum SgrAttrBits
+{
+	sgr_Bold = 0x01, sgr_Faint = 0x02, sgr_Italic = 0x04, sgr_Underline = 0x08,
+	sgr_Blink = 0x10, sgr_Inverse = 0x20, sgr_Hidden = 0x40, sgr_Strike = 0x80,
+};
+// Colors: -1 is default, 0..15 are 30-37/90-97, 256+n is 38;5;n, SGR_RGB|rgb is 38;2;r;g;b
+#define SGR_RGB 0x1000000
+struct SgrState
+{
+	unsigned attrs;
+	int fg, bg;
+};
+struct SgrMinimizer
+{
+	bool enabled;
+	bool opaque;        // host rendition is unknown after unsupported parameters
+	bool dirty;         // pending differs from emitted
+	SgrState emitted, pending;
+	SgrState saved;     // rendition saved with the cursor by the host
+	bool saved_opaque;
+	unsigned long long seqs, dropped, bytes_in, bytes_out;
+};
+static SgrMinimizer sgr_min = {false, false, false, {0, -1, -1}, {0, -1, -1}, {0, -1, -1}};
+static const SgrState sgr_default = {0, -1, -1};
+
+static bool sgr_equal(const SgrState& a, const SgrState& b)
+{
+	return a.attrs == b.attrs && a.fg == b.fg && a.bg == b.bg;
+}
+
+// Applies SGR token to the state, returns false if there were unknown parameters
+static bool sgr_apply(SgrState& st, const VtToken& tok)
+{
+	char prefix, final;
+	int params[32];
+	if (memchr(tok.ptr, ':', tok.len))
+		return false; // sub-parameters are not supported
+	int count = vt_csi_params(tok, prefix, params, 32, final);
+	if (count == 32)
+		return false;
+	if (!count)
+	{
+		st = sgr_default;
+		return true;
+	}
+	bool known = true;
+	for (int i = 0; i < count; ++i)
+	{
+		int p = params[i];
+		switch (p)
+		{
+		case 0: st = sgr_default; break;
+		case 1: st.attrs |= sgr_Bold; break;
+		case 2: st.attrs |= sgr_Faint; break;
+		case 3: st.attrs |= sgr_Italic; break;
+		case 4: st.attrs |= sgr_Underline; break;
+		case 5: st.attrs |= sgr_Blink; break;
+		case 7: st.attrs |= sgr_Inverse; break;
+		case 8: st.attrs |= sgr_Hidden; break;
+		case 9: st.attrs |= sgr_Strike; break;
+		case 22: st.attrs &= ~(sgr_Bold|sgr_Faint); break;
+		case 23: st.attrs &= ~sgr_Italic; break;
+		case 24: st.attrs &= ~sgr_Underline; break;
+		case 25: st.attrs &= ~sgr_Blink; break;
+		case 27: st.attrs &= ~sgr_Inverse; break;
+		case 28: st.attrs &= ~sgr_Hidden; break;
+		case 29: st.attrs &= ~sgr_Strike; break;
+		case 39: st.fg = -1; break;
+		case 49: st.bg = -1; break;
+		case 38: case 48:
+		{
+			int color = -2;
+			if (i + 2 < count && params[i+1] == 5 && params[i+2] <= 255)
+			{
+				color = 256 + params[i+2];
+				i += 2;
+			}
+			else if (i + 4 < count && params[i+1] == 2 && params[i+2] <= 255 && params[i+3] <= 255 && params[i+4] <= 255)
+			{
+				color = SGR_RGB | (params[i+2] << 16) | (params[i+3] << 8) | params[i+4];
+				i += 4;
+			}
+			if (color == -2)
+				return false;
+			if (p == 38)
+				st.fg = color;
+			else
+				st.bg = color;
+			break;
+		}
+		default:
+			if (p >= 30 && p <= 37)
+				st.fg = p - 30;
+			else if (p >= 40 && p <= 47)
+				st.bg = p - 40;
+			else if (p >= 90 && p <= 97)
+				st.fg = p - 90 + 8;
+			else if (p >= 100 && p <= 107)
+				st.bg = p - 100 + 8;
+			else
+				known = false;
+		}
+	}
+	return known;
+}
+
+static int sgr_format_color(char* buf, int color, bool bg)
+{
+	if (color < 0)
+		return sprintf(buf, ";%i", bg ? 49 : 39);
+	if (color < 8)
+		return sprintf(buf, ";%i", (bg ? 40 : 30) + color);
+	if (color < 16)
+		return sprintf(buf, ";%i", (bg ? 100 : 90) + color - 8);
+	if (color < 512)
+		return sprintf(buf, ";%i;5;%i", bg ? 48 : 38, color - 256);
+	return sprintf(buf, ";%i;2;%i;%i;%i", bg ? 48 : 38, (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
+}
+
+// Parameters (with leading ';') turning `from` rendition into `to`
+static int sgr_format_diff(char* buf, const SgrState& from, const SgrState& to)
+{
+	static const struct { unsigned bit; int on, off; } attrs[] = {
+		{sgr_Bold, 1, 22}, {sgr_Faint, 2, 22}, {sgr_Italic, 3, 23}, {sgr_Underline, 4, 24},
+		{sgr_Blink, 5, 25}, {sgr_Inverse, 7, 27}, {sgr_Hidden, 8, 28}, {sgr_Strike, 9, 29},
+	};
+	int len = 0;
+	unsigned attrs_on = from.attrs;
+	// 22 resets both bold and faint
+	if ((from.attrs & ~to.attrs) & (sgr_Bold|sgr_Faint))
+	{
+		len += sprintf(buf + len, ";22");
+		attrs_on &= ~(sgr_Bold|sgr_Faint);
+	}
+	for (size_t i = 0; i < sizeof(attrs)/sizeof(attrs[0]); ++i)
+	{
+		bool was = (attrs_on & attrs[i].bit) != 0, now = (to.attrs & attrs[i].bit) != 0;
+		if (was != now)
+			len += sprintf(buf + len, ";%i", now ? attrs[i].on : attrs[i].off);
+	}
+	if (from.fg != to.fg)
+		len += sgr_format_color(buf + len, to.fg, false);
+	if (from.bg != to.bg)
+		len += sgr_format_color(buf + len, to.bg, true);
+	return len;
+}
+
+static void sgr_flush()
+{
+	if (!sgr_min.dirty)
+		return;
+	sgr_min.dirty = false;
+	if (sgr_equal(sgr_min.emitted, sgr_min.pending))
+		return;
+
+	char diff[128], reset[128], seq[140];
+	int diff_len = sgr_format_diff(diff, sgr_min.emitted, sgr_min.pending);
+	int reset_len = sgr_format_diff(reset, sgr_default, sgr_min.pending);
+	int len;
+	if (!reset_len)
+		len = sprintf(seq, "\033[m");
+	else if (reset_len + 2 < diff_len)
+		len = sprintf(seq, "\033[0%sm", reset);
+	else
+		len = sprintf(seq, "\033[%sm", diff + 1);
+	sgr_min.bytes_out += len;
+	sgr_min.emitted = sgr_min.pending;
+	filter_emit_copy(of_Sgr, vt_CSI, seq, len);
+}
+
+enum SgrCursorOp
+{
+	sc_None,
+	sc_Save,      // ESC 7, CSI s, CSI ? 1048/1049 h
+	sc_Restore,   // ESC 8, CSI u, CSI ? 1048/1049 l
+	sc_Reset,     // ESC c, CSI ! p: default rendition, saved one too
+};
+
+static SgrCursorOp sgr_cursor_op(const VtToken& tok)
+{
+	if (tok.type == vt_Esc && tok.len == 2)
+		return (tok.ptr[1] == '7') ? sc_Save : (tok.ptr[1] == '8') ? sc_Restore : (tok.ptr[1] == 'c') ? sc_Reset : sc_None;
+	if (tok.type != vt_CSI)
+		return sc_None;
+	char last = tok.ptr[tok.len - 1];
+	if (tok.len == 3)
+		return (last == 's') ? sc_Save : (last == 'u') ? sc_Restore : sc_None;
+	if (tok.len == 4 && tok.ptr[2] == '!' && last == 'p')
+		return sc_Reset;
+	if (tok.ptr[2] == '?' && (last == 'h' || last == 'l') && !vt_csi_intermediate(tok))
+	{
+		char prefix, final;
+		int params[16];
+		int count = vt_csi_params(tok, prefix, params, 16, final);
+		for (int i = 0; i < count; ++i)
+			if (params[i] == 1048 || params[i] == 1049)
+				return (last == 'h') ? sc_Save : sc_Restore;
+	}
+	return sc_None;
+}
+
+static bool sgr_process(const VtToken& tok)
+{
+	if (!sgr_min.enabled)
+		return false;
+	if (tok.type != vt_CSI || tok.ptr[tok.len - 1] != 'm' || vt_csi_intermediate(tok)
+		|| (tok.len > 2 && tok.ptr[2] >= '<' && tok.ptr[2] <= '?'))
+	{
+		sgr_flush();
+		switch (sgr_cursor_op(tok))
+		{
+		case sc_Save:
+			sgr_min.saved = sgr_min.emitted;
+			sgr_min.saved_opaque = sgr_min.opaque;
+			break;
+		case sc_Restore:
+			sgr_min.pending = sgr_min.emitted = sgr_min.saved;
+			sgr_min.opaque = sgr_min.saved_opaque;
+			break;
+		case sc_Reset:
+			sgr_min.pending = sgr_min.emitted = sgr_min.saved = sgr_default;
+			sgr_min.opaque = sgr_min.saved_opaque = false;
+			break;
+		default:
+			break;
+		}
+		return false;
+	}
+
+	sgr_min.seqs++;
+	sgr_min.bytes_in += tok.len;
+	SgrState st = sgr_min.pending;
+	bool known = sgr_apply(st, tok);
+	if (!known || sgr_min.opaque)
+	{
+		// pass as is, the host rendition is unknown until full reset
+		sgr_flush();
+		// "CSI m", "CSI 0;... m" and "CSI ;... m" start with full reset
+		bool reset = (tok.len == 3) || (tok.ptr[2] == ';') || (tok.ptr[2] == '0' && (tok.ptr[3] == ';' || tok.ptr[3] == 'm'));
+		sgr_min.pending = sgr_min.emitted = st;
+		sgr_min.opaque = !known || (sgr_min.opaque && !reset);
+		sgr_min.bytes_out += tok.len;
+		filter_emit(of_Sgr, tok.type, tok.ptr, tok.len);
+		return true;
+	}
+	sgr_min.pending = st;
+	sgr_min.dirty = true;
+	sgr_min.dropped++;
+	return true;
+}
+
+static VtScanner out_scanner = {};
+
+// Command timing by shell integration marks (FinalTerm, OSC 133):
+// A - prompt starts, B - prompt ends and the command is typed,
+// C - the command starts, D[;exit] - the command finished.
+// The command line is the echoed text between B and C.
+// Switch `--cmd-csv <file>` appends a row per command, `--no-cmd-timing` disables the stage.
+#define CMD_TEXT_MAX 256
+enum CommandPhase
+{
+	cp_None,
+	cp_Prompt,      // after A
+	cp_Input,       // after B
+	cp_Running,     // after C
+};
+struct CommandTiming
+{
+	bool enabled;
+	CommandPhase phase;
+	char text[CMD_TEXT_MAX];
+	int text_len;
+	long long start_us, start_ms;
+	unsigned long long out_bytes;
+	int csv_fd;                 // -1 until the first command finished
+	const char* csv_path;
+	unsigned count, failed;
+	long long total_us;
+	long long max_us;
+	char max_text[CMD_TEXT_MAX];
+};
+static CommandTiming cmd_timing = {true, cp_None, {}, 0, 0, 0, 0, -1};
+
+static void cmd_csv_write(long long duration_us, int exit_code)
+{
+	if (cmd_timing.csv_fd < 0)
+		return;
+	char row[CMD_TEXT_MAX * 2 + 128];
+	int len = sprintf(row, "%lld,%lld,%i,%llu,\"", cmd_timing.start_ms, duration_us / 1000, exit_code, cmd_timing.out_bytes);
+	for (int i = 0; i < cmd_timing.text_len; ++i)
+	{
+		if (cmd_timing.text[i] == '"')
+			row[len++] = '"';
+		row[len++] = cmd_timing.text[i];
+	}
+	len += sprintf(row + len, "\"\n");
+	write(cmd_timing.csv_fd, row, len);
+}
+
+static void cmd_open_csv()
+{
+	cmd_timing.csv_fd = open(cmd_timing.csv_path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if (cmd_timing.csv_fd < 0)
+	{
+		write_verbose("\r\n\033[31;40m{PID:%u} can't open `%s`: %s\033[m\r\n", getpid(), cmd_timing.csv_path, strerror(errno));
+		// don't retry on every command
+		cmd_timing.csv_path = NULL;
+		return;
+	}
+	fcntl(cmd_timing.csv_fd, F_SETFD, FD_CLOEXEC);
+	struct stat st = {};
+	if (fstat(cmd_timing.csv_fd, &st) == 0 && st.st_size == 0)
+	{
+		const char header[] = "start_ms,duration_ms,exit_code,output_bytes,command\n";
+		write(cmd_timing.csv_fd, header, sizeof(header) - 1);
+	}
+}
+
+static void cmd_finished(int exit_code)
+{
+	long long duration = get_time_us() - cmd_timing.start_us;
+	cmd_timing.count++;
+	if (exit_code != 0)
+		cmd_timing.failed++;
+	cmd_timing.total_us += duration;
+	if (duration >= cmd_timing.max_us)
+	{
+		cmd_timing.max_us = duration;
+		memcpy(cmd_timing.max_text, cmd_timing.text, cmd_timing.text_len + 1);
+	}
+	if (cmd_timing.csv_path)
+	{
+		if (cmd_timing.csv_fd < 0)
+			cmd_open_csv();
+		cmd_csv_write(duration, exit_code);
+	}
+	if (verbose)
+		write_verbose("\r\n\033[32;40m{PID:%u} command `%s` took %lldms, exit=%i, output=%llu bytes\033[m\r\n",
+			getpid(), cmd_timing.text, duration / 1000, exit_code, cmd_timing.out_bytes);
+}
+
+// Echoed command line, escape sequences are not passed here
+static void cmd_append_text(const char* ptr, int len)
+{
+	for (int i = 0; i < len && cmd_timing.text_len < CMD_TEXT_MAX - 1; ++i)
+	{
+		char c = ptr[i];
+		if (c == '\b' && cmd_timing.text_len)
+			cmd_timing.text_len--;
+		else if ((unsigned char)c >= 0x20 && c != 0x7F)
+			cmd_timing.text[cmd_timing.text_len++] = c;
+	}
+	cmd_timing.text[cmd_timing.text_len] = 0;
+}
+
+static bool cmd_process(const VtToken& tok)
+{
+	if (!cmd_timing.enabled)
+		return false;
+	if (cmd_timing.phase == cp_Running)
+		cmd_timing.out_bytes += tok.len;
+	if (tok.type == vt_Text)
+	{
+		if (cmd_timing.phase == cp_Input)
+			cmd_append_text(tok.ptr, tok.len);
+		return false;
+	}
+	// "ESC ] 133 ; X [; args] BEL|ST"
+	if (tok.type != vt_OSC || tok.len < 8 || memcmp(tok.ptr + 2, "133;", 4) != 0)
+		return false;
+
+	char mark = tok.ptr[6];
+	switch (mark)
+	{
+	case 'A':
+		cmd_timing.phase = cp_Prompt;
+		break;
+	case 'B':
+		cmd_timing.phase = cp_Input;
+		cmd_timing.text_len = 0;
+		cmd_timing.text[0] = 0;
+		break;
+	case 'C':
+		cmd_timing.phase = cp_Running;
+		cmd_timing.start_us = get_time_us();
+		cmd_timing.start_ms = get_realtime_ms();
+		cmd_timing.out_bytes = 0;
+		break;
+	case 'D':
+		if (cmd_timing.phase == cp_Running)
+		{
+			// the mark itself is not output of the command
+			cmd_timing.out_bytes -= tok.len;
+			cmd_finished((tok.ptr[7] == ';') ? atoi(tok.ptr + 8) : 0);
+		}
+		cmd_timing.phase = cp_None;
+		break;
+	}
+	return false;
+}
+
+// Recent output, it's restarted on screen clear, so usually it contains only
+// the current screen. The holder repaints new clients with it, hidden tabs are
+// repainted with it when shown. The rendition (SGR) is followed over all output,
+// the replay starts with the rendition which was current where the kept part starts.
+#define REPLAY_MAX (256*1024)
+struct ReplayPen
+{
+	SgrState cur;
+	SgrState saved;     // by DECSC, SCOSC, ?1048 and ?1049
+};
+static char* replay_buf = NULL;
+static int replay_used = 0;
+static bool replay_cut = false;   // the older part was dropped, the screen was not cleared since
+static unsigned long long replay_dropped = 0;  // bytes dropped since the last restart
+static ReplayPen replay_pen = {{0, -1, -1}, {0, -1, -1}};        // at the end of the output
+static ReplayPen replay_start_pen = {{0, -1, -1}, {0, -1, -1}};  // at the start of replay_buf
+static VtScanner replay_scanner = {};
+
+static void replay_pen_apply(ReplayPen& pen, const VtToken& tok)
+{
+	if (tok.type == vt_CSI && tok.ptr[tok.len - 1] == 'm' && !vt_csi_intermediate(tok)
+		&& !(tok.len > 2 && tok.ptr[2] >= '<' && tok.ptr[2] <= '?'))
+	{
+		sgr_apply(pen.cur, tok);
+		return;
+	}
+	switch (sgr_cursor_op(tok))
+	{
+	case sc_Save:
+		pen.saved = pen.cur;
+		break;
+	case sc_Restore:
+		pen.cur = pen.saved;
+		break;
+	case sc_Reset:
+		pen.cur = pen.saved = sgr_default;
+		break;
+	default:
+		break;
+	}
+}
+
+// Called by modes_process for every token of the output
+static void replay_track_pen(const VtToken& tok)
+{
+	if (tok.type == vt_CSI || tok.type == vt_Esc)
+		replay_pen_apply(replay_pen, tok);
+}
+
+// The rendition at the start of replay_buf follows the dropped output
+static void replay_drop(const char* data, int len)
+{
+	const char* p = data;
+	const char* end = data + len;
+	VtToken tok;
+	while (vt_next(replay_scanner, p, end, tok))
+		replay_pen_apply(replay_start_pen, tok);
+	vt_flush(replay_scanner, tok);
+	replay_scanner.state = vs_Ground;
+	replay_dropped += len;
+	replay_cut = true;
+}
+
+// "CSI 0;...m" setting the rendition of the replay start
+static int replay_format_pen(char* buf)
+{
+	int len = sprintf(buf, "\033[0");
+	len += sgr_format_diff(buf + len, sgr_default, replay_start_pen.cur);
+	buf[len++] = 'm';
+	buf[len] = 0;
+	return len;
+}
+
+// modes_process is the first stage, the restarting token is in replay_pen already
+static void replay_reset()
+{
+	replay_used = 0;
+	replay_cut = false;
+	replay_dropped = 0;
+	replay_start_pen = replay_pen;
+}
+
+static bool replay_restarts(const VtToken& tok)
+{
+	if (tok.type == vt_Esc)
+		return (tok.len == 2 && tok.ptr[1] == 'c');
+	if (tok.type != vt_CSI || vt_csi_intermediate(tok))
+		return false;
+	char prefix, final;
+	int params[8];
+	int count = vt_csi_params(tok, prefix, params, 8, final);
+	if (!prefix && final == 'J')
+		return (count > 0 && params[0] >= 2);
+	if (prefix == '?' && (final == 'h' || final == 'l'))
+	{
+		for (int i = 0; i < count; ++i)
+			if (params[i] == 47 || params[i] == 1047 || params[i] == 1049)
+				return true;
+	}
+	return false;
+}
+
+static void replay_append(const char* data, int len)
+{
+	if (!replay_buf && !(replay_buf = (char*)malloc(REPLAY_MAX)))
+		return;
+	if (len > REPLAY_MAX / 2)
+	{
+		// Keep the tail of the data, starting from the line break
+		replay_drop(replay_buf, replay_used);
+		replay_used = 0;
+		const char* cut = (const char*)memchr(data + len - REPLAY_MAX / 2, '\n', REPLAY_MAX / 2);
+		int drop = cut ? (int)(cut + 1 - data) : (len - REPLAY_MAX / 2);
+		replay_drop(data, drop);
+		data += drop;
+		len -= drop;
+	}
+	if (replay_used + len > REPLAY_MAX)
+	{
+		// Drop the older half, starting from the line break
+		const char* cut = (const char*)memchr(replay_buf + REPLAY_MAX / 2, '\n', replay_used - REPLAY_MAX / 2);
+		int drop = cut ? (cut + 1 - replay_buf) : replay_used;
+		replay_drop(replay_buf, drop);
+		memmove(replay_buf, replay_buf + drop, replay_used - drop);
+		replay_used -= drop;
+	}
+	memcpy(replay_buf + replay_used, data, len);
+	replay_used += len;
+}
+
+// Hidden tabs: the host reports the visibility of the tab with Connector.IsTabVisible.
+// While the tab is hidden its output is logged as usual but is not passed to the host,
+// only the recent output is kept; OSC sequences (title, cwd, notifications) pass as is.
+// Queries pass to the host, the application waits for the reply.
+// When the tab is shown the kept output is written in one call, starting with the
+// rendition where the kept part starts. If it was cut, full screen applications are
+// repainted from the cleared state and get SIGWINCH to redraw, on the main screen
+// the dropped part is marked.
+// Switch `--no-background` passes all output to hidden tabs.
+struct BackgroundMode
+{
+	bool enabled;
+	bool hidden;                    // the stage is in the chain while the tab is hidden
+	long long since_us;
+	unsigned hides, repaints, nudges;
+	long long hidden_us;
+	unsigned long long bytes;       // output kept off the host
+	unsigned long long payload_bytes;  // long strings (images) dropped
+};
+static BackgroundMode background = {true};
+
+// Write the kept output to the host, when the tab is shown or before
+// the host answers the cursor position
+static void background_repaint()
+{
+	// the output was logged already
+	if (replay_cut)
+	{
+		// The alternate screen is cleared and redrawn by the application. The main
+		// screen is not cleared, the host keeps it in the scrollback, and the gap
+		// in the output is marked so it's not lost silently.
+		char prefix[600];
+		int len = format_term_modes(prefix, term_modes);
+		if (term_modes & tm_AltScreen)
+			len += sprintf(prefix + len, "\033[H\033[2J");
+		else if (log_streams[1].path)
+			len += sprintf(prefix + len, "\033[m\r\n\033[33m[%llu bytes of output dropped while the tab was hidden, see %.256s]\033[m\r\n",
+				replay_dropped, log_streams[1].path);
+		else
+			len += sprintf(prefix + len, "\033[m\r\n\033[33m[%llu bytes of output dropped while the tab was hidden]\033[m\r\n",
+				replay_dropped);
+		len += replay_format_pen(prefix + len);
+		write_console(prefix, len, wps_Output, false);
+	}
+	if (replay_used)
+		write_console(replay_buf, replay_used, wps_Output, false);
+	background.repaints++;
+	if (replay_cut && (term_modes & tm_AltScreen) && pty_fd >= 0)
+	{
+		struct winsize winp = {};
+		if (ioctl(pty_fd, TIOCGWINSZ, &winp) == 0 && winp.ws_col && winp.ws_row)
+		{
+			nudge_pty_size(pty_fd, &winp);
+			background.nudges++;
+		}
+	}
+	if (verbose)
+		write_verbose("\r\n\033[32;40m{PID:%u} kept output written, %i bytes repainted, %llu bytes dropped\033[m\r\n",
+			getpid(), replay_used, replay_dropped);
+	replay_reset();
+}
+
+// CPR and DECXCPR, the host must have the kept output to answer them
+static bool background_cpr(const VtToken& tok)
+{
+	if (tok.type != vt_CSI || tok.ptr[tok.len - 1] != 'n' || vt_csi_intermediate(tok))
+		return false;
+	char prefix, final;
+	int params[2];
+	int count = vt_csi_params(tok, prefix, params, 2, final);
+	return count == 1 && params[0] == 6 && (!prefix || prefix == '?');
+}
+
+// Queries the application waits the reply for: DA (CSI c), DSR and CPR (CSI n),
+// window reports (CSI t), DECRQM (CSI $ p), kitty keyboard flags (CSI ? u),
+// DECRQSS (DCS $ q) and XTGETTCAP (DCS + q)
+static bool background_query(const VtToken& tok)
+{
+	if (tok.type == vt_DCS)
+		return tok.len > 4 && (tok.ptr[2] == '$' || tok.ptr[2] == '+') && tok.ptr[3] == 'q';
+	if (tok.type != vt_CSI || tok.len < 3)
+		return false;
+	char last = tok.ptr[tok.len - 1];
+	char intermediate = vt_csi_intermediate(tok);
+	switch (last)
+	{
+	case 'c':
+	case 'n':
+		return !intermediate;
+	case 'p':
+		return intermediate == '$';
+	case 'u':
+		return tok.len == 4 && tok.ptr[2] == '?';
+	case 't':
+	{
+		char prefix, final;
+		int params[4];
+		int count = vt_csi_params(tok, prefix, params, 4, final);
+		// 11, 13-21 report the window state, others change it
+		return !prefix && !intermediate && count && (params[0] == 11 || (params[0] >= 13 && params[0] <= 21));
+	}
+	}
+	return false;
+}
+
+static bool background_process(const VtToken& tok)
+{
+	bool payload = (tok.type == vt_Raw && out_scanner.raw);
+	if (tok.type == vt_OSC || (payload && out_scanner.seq_type == vt_OSC))
+		return false;
+	// the host answers queries, they are not kept for the repaint either
+	if (background_query(tok))
+	{
+		if (background_cpr(tok))
+		{
+			out_flush();
+			background_repaint();
+		}
+		return false;
+	}
+	// keep the order of the log, the passed OSC may be in the gather buffer
+	if (out_span_len > 0)
+		out_flush();
+	log_output(tok.ptr, tok.len);
+	// images are not repainted, don't let them push the text out of the buffer
+	if (payload)
+	{
+		background.payload_bytes += tok.len;
+		return true;
+	}
+	if (replay_restarts(tok))
+		replay_reset();
+	replay_append(tok.ptr, tok.len);
+	background.bytes += tok.len;
+	return true;
+}
+
+// Terminal queries answered by the connector, the reply is written into the pty
+// right away instead of the round trip through the host and ReadInput:
+// DSR status (CSI 5 n), DECRQM of synchronized output (CSI ? 2026 $ p), XTVERSION (CSI > q),
+// DA1 and DA2 (CSI c, CSI > c) once the host has answered them, its reply is taken
+// from the input. Other queries (cursor position, other modes) go to the host, even from
+// the hidden tab; the kept output of the hidden tab is written before the cursor position query.
+// Switch `--no-local-queries` passes all of them to the host.
+#define QUERY_REPLY_MAX 64
+struct LocalQueries
+{
+	bool enabled;
+	char da1[QUERY_REPLY_MAX], da2[QUERY_REPLY_MAX];   // replies of the host, empty until learned
+	int waiting;                    // DA queries passed to the host and not answered yet
+	char input[QUERY_REPLY_MAX];    // reply being received
+	int input_len;
+	unsigned answered, forwarded, learned;
+};
+static LocalQueries queries = {true};
+
+// The hidden tab passes the query to the host too, the application waits for the reply
+static void query_forward(const VtToken& tok)
+{
+	queries.forwarded++;
+	if (background.hidden)
+	{
+		out_flush();
+		if (background_cpr(tok))
+			background_repaint();
+		write_console(tok.ptr, tok.len);
+	}
+}
+
+static bool query_answer(const char* reply, int len)
+{
+	reply_to_pty(reply, len);
+	queries.answered++;
+	return true;
+}
+
+static bool query_process(const VtToken& tok)
+{
+	if (!queries.enabled || tok.type != vt_CSI || tok.len < 3)
+		return false;
+	char last = tok.ptr[tok.len - 1];
+	if (last != 'c' && last != 'n' && last != 'p' && last != 'q')
+		return false;
+
+	char prefix, final;
+	int params[4];
+	int count = vt_csi_params(tok, prefix, params, 4, final);
+	char intermediate = vt_csi_intermediate(tok);
+	char reply[QUERY_REPLY_MAX + 16];
+
+	if (final == 'c' && !intermediate && (!prefix || prefix == '>') && (!count || params[0] == 0))
+	{
+		// DA1, DA2
+		const char* known = prefix ? queries.da2 : queries.da1;
+		if (*known)
+			return query_answer(known, strlen(known));
+		queries.waiting++;
+	}
+	else if (final == 'n' && !prefix && !intermediate && count == 1 && params[0] == 5)
+	{
+		return query_answer("\033[0n", 4);
+	}
+	else if (final == 'p' && prefix == '?' && intermediate == '$' && count == 1)
+	{
+		// DECRQM, Ps: 1 - set, 2 - reset. Only the synchronized output is ours,
+		// the host knows other modes better (defaults, modes it doesn't support)
+		if (term_mode_bit(params[0]) == tm_SyncOutput && sync_output.enabled)
+			return query_answer(reply, sprintf(reply, "\033[?%i;%i$y", params[0], sync_output.mode ? 1 : 2));
+	}
+	else if (final == 'q' && prefix == '>' && !intermediate && (!count || params[0] == 0))
+	{
+		// XTVERSION
+		return query_answer(reply, sprintf(reply, "\033P>|ConEmu-connector(%s)\033\\", VERSION_S));
+	}
+	else if (!(final == 'n' && !intermediate && count == 1 && params[0] == 6))
+	{
+		return false;
+	}
+
+	// the host answers: DA before its reply is known, other modes, cursor position
+	query_forward(tok);
+	return background.hidden;
+}
+
+// Input from the host while DA queries wait for the reply, the reply is remembered
+static void query_input(const char* s, int len)
+{
+	if (queries.waiting <= 0)
+		return;
+	for (int i = 0; i < len; ++i)
+	{
+		char c = s[i];
+		if (!queries.input_len && c != 27)
+			continue;
+		queries.input[queries.input_len++] = c;
+		if ((queries.input_len == 2 && c != '[')
+			|| (queries.input_len == 3 && c != '?' && c != '>')
+			|| (queries.input_len > 3 && !(isdigit((unsigned char)c) || c == ';' || c == 'c'))
+			|| queries.input_len >= QUERY_REPLY_MAX)
+		{
+			queries.input_len = (c == 27) ? (queries.input[0] = c, 1) : 0;
+			continue;
+		}
+		if (c != 'c' || queries.input_len < 4)
+			continue;
+		char* known = (queries.input[2] == '?') ? queries.da1 : queries.da2;
+		memcpy(known, queries.input, queries.input_len);
+		known[queries.input_len] = 0;
+		queries.input_len = 0;
+		queries.learned++;
+		queries.waiting--;
+	}
+}
+
+// Output triggers, switches `--trigger <text>`, `--trigger-re <regex>` and `--trigger-hook <command>`.
+// Literals of all triggers are compiled into one Aho-Corasick DFA which runs over
+// text tokens only, so escape sequences between the letters don't break matches,
+// and its state is kept between reads. From the root state the scanner jumps to the
+// next possible first byte with memchr (vectorized in libc) or a byte table.
+// Regex triggers use their longest literal as the key and are verified by regexec()
+// on the current line when the line ends, or when the output went idle after
+// a line without LF (prompts).
+// On match the host gets OSC 9 notification, or the hook is spawned with
+// CONNECTOR_TRIGGER and CONNECTOR_LINE in the environment. The pump doesn't
+// wait for hooks, they are reaped on SIGCHLD.
+#define TRIGGER_MAX 64
+#define TRIGGER_LINE_MAX 1024
+#define TRIGGER_MAX_HOOKS 16
+#define TRIGGER_MAX_STATES 0xFFFF  // states of the DFA are unsigned short, one per key byte at most
+struct Trigger
+{
+	char* pattern;          // as given in the switch
+	char* key;              // literal searched by the DFA, empty if the regex has none
+	bool is_regex;
+	regex_t re;
+	long long last_us;      // when it fired last time
+};
+struct TriggerEngine
+{
+	bool enabled;
+	Trigger triggers[TRIGGER_MAX];
+	int count;
+	int key_bytes;          // sum of key lengths, limits the DFA size
+	char* hook;
+	// DFA: delta[state * 256 + byte], out[state] is the mask of triggers ending there
+	unsigned short* delta;
+	unsigned long long* out;
+	int states;
+	unsigned short state;
+	bool first_byte[256];   // bytes which leave the root state
+	int first_count;
+	unsigned char first_only; // the single first byte, when first_count == 1
+	unsigned long long anchorless; // regex triggers without key, verified on every line
+	unsigned long long pending;    // regex triggers with found key on the current line
+	unsigned long long fired;      // triggers fired on the current line
+	unsigned long long matched;    // and not reported yet
+	char line[TRIGGER_LINE_MAX];
+	int line_len;
+	char notify[4096];      // notifications, emitted after the token which caused them
+	int notify_len;
+	pid_t hook_pids[TRIGGER_MAX_HOOKS];  // running hooks, not reaped yet
+	int hook_count;
+	unsigned long long bytes;
+	unsigned hits, verified, notified, hooks, suppressed;
+};
+static TriggerEngine trigger = {};
+const long long trigger_interval_us = 1000000;  // the same trigger fires at most once per second
+
+// The longest run of literal characters of the regex, empty if there is alternation
+static char* trigger_regex_key(const char* re)
+{
+	char* key = (char*)calloc(strlen(re) + 1, 1);
+	char* run = (char*)calloc(strlen(re) + 1, 1);
+	int key_len = 0, run_len = 0, depth = 0;
+	for (const char* p = re; *p; ++p)
+	{
+		char c = *p;
+		bool literal = false;
+		if (c == '\\' && p[1])
+		{
+			c = *(++p);
+			literal = !isalnum((unsigned char)c);  // \d, \w are classes in some engines
+		}
+		else if (c == '|')
+		{
+			key_len = 0;
+			break;
+		}
+		else if (c == '[')
+		{
+			// skip the bracket expression, `]` may be its first member
+			const char* q = p + 1;
+			if (*q == '^') ++q;
+			if (*q == ']') ++q;
+			while (*q && *q != ']') ++q;
+			p = *q ? q : q - 1;
+		}
+		else if (c == '(') ++depth;
+		else if (c == ')') --depth;
+		else
+			literal = !strchr(".*+?{}^$", c);
+
+		// the char followed by `*`, `?` or `{` is optional
+		if (literal && depth == 0 && !(p[1] && strchr("*?{", p[1])))
+		{
+			run[run_len++] = c;
+			if (run_len > key_len)
+			{
+				memcpy(key, run, run_len);
+				key_len = run_len;
+			}
+			continue;
+		}
+		run_len = 0;
+	}
+	key[key_len] = 0;
+	free(run);
+	return key;
+}
+
+static bool trigger_add(const char* pattern, bool is_regex)
+{
+	if (trigger.count >= TRIGGER_MAX || !*pattern)
+	{
+		printf("{PID:%u} %s\r\n", getpid(), *pattern ? "too many triggers" : "empty trigger");
+		return false;
+	}
+	Trigger& t = trigger.triggers[trigger.count];
+	memset(&t, 0, sizeof(t));
+	t.is_regex = is_regex;
+	if (is_regex)
+	{
+		int rc = regcomp(&t.re, pattern, REG_EXTENDED|REG_NOSUB);
+		if (rc != 0)
+		{
+			char err[200];
+			regerror(rc, &t.re, err, sizeof(err));
+			printf("{PID:%u} invalid trigger `%s`: %s\r\n", getpid(), pattern, err);
+			return false;
+		}
+		t.key = trigger_regex_key(pattern);
+	}
+	else
+	{
+		t.key = strdup(pattern);
+	}
+	int key_len = (int)strlen(t.key);
+	if (1 + trigger.key_bytes + key_len > TRIGGER_MAX_STATES)
+	{
+		printf("{PID:%u} trigger `%s` exceeds the limit of %i bytes of all triggers\r\n", getpid(), pattern, TRIGGER_MAX_STATES - 1);
+		free(t.key);
+		if (is_regex)
+			regfree(&t.re);
+		memset(&t, 0, sizeof(t));
+		return false;
+	}
+	trigger.key_bytes += key_len;
+	t.pattern = strdup(pattern);
+	trigger.count++;
+	trigger.enabled = true;
+	return true;
+}
+
+// Build the DFA of all keys, breadth-first for the failure links
+static void trigger_compile()
+{
+	int max_states = 1;
+	for (int i = 0; i < trigger.count; ++i)
+		max_states += strlen(trigger.triggers[i].key);
+	max_states = _min(max_states, TRIGGER_MAX_STATES);
+	free(trigger.delta);
+	free(trigger.out);
+	trigger.delta = (unsigned short*)calloc((size_t)max_states * 256, sizeof(unsigned short));
+	trigger.out = (unsigned long long*)calloc(max_states, sizeof(unsigned long long));
+	int* fail = (int*)calloc(max_states, sizeof(int));
+	int* queue = (int*)calloc(max_states, sizeof(int));
+	bool* has_edge = (bool*)calloc((size_t)max_states * 256, sizeof(bool));
+	trigger.states = 1;
+	trigger.anchorless = 0;
+
+	// trie
+	for (int i = 0; i < trigger.count; ++i)
+	{
+		const unsigned char* key = (const unsigned char*)trigger.triggers[i].key;
+		if (!*key)
+		{
+			trigger.anchorless |= 1ULL << i;
+			continue;
+		}
+		int state = 0;
+		for (; *key; ++key)
+		{
+			int edge = state * 256 + *key;
+			if (!has_edge[edge])
+			{
+				if (trigger.states >= max_states)
+					break;
+				has_edge[edge] = true;
+				trigger.delta[edge] = trigger.states++;
+			}
+			state = trigger.delta[edge];
+		}
+		// a prefix of the key must not fire the trigger, trigger_add keeps it from happening
+		if (*key)
+			write_verbose("\r\n\033[31;40m{PID:%u} trigger `%s` is dropped, too many states\033[m\r\n", getpid(), trigger.triggers[i].pattern);
+		else
+			trigger.out[state] |= 1ULL << i;
+	}
+
+	// failure links turn the trie into DFA
+	int head = 0, tail = 0;
+	for (int c = 0; c < 256; ++c)
+		if (has_edge[c])
+			queue[tail++] = trigger.delta[c];
+	while (head < tail)
+	{
+		int state = queue[head++];
+		trigger.out[state] |= trigger.out[fail[state]];
+		for (int c = 0; c < 256; ++c)
+		{
+			int edge = state * 256 + c;
+			if (has_edge[edge])
+			{
+				int next = trigger.delta[edge];
+				fail[next] = trigger.delta[fail[state] * 256 + c];
+				queue[tail++] = next;
+			}
+			else
+			{
+				trigger.delta[edge] = trigger.delta[fail[state] * 256 + c];
+			}
+		}
+	}
+
+	trigger.first_count = 0;
+	for (int c = 0; c < 256; ++c)
+	{
+		trigger.first_byte[c] = (trigger.delta[c] != 0);
+		if (trigger.first_byte[c])
+		{
+			trigger.first_only = (unsigned char)c;
+			trigger.first_count++;
+		}
+	}
+	trigger.state = 0;
+	free(fail);
+	free(queue);
+	free(has_edge);
+}
+
+static void trigger_fire(int i)
+{
+	Trigger& t = trigger.triggers[i];
+	trigger.fired |= 1ULL << i;
+	long long now = get_time_us();
+	if (t.last_us && (now - t.last_us) < trigger_interval_us)
+	{
+		trigger.suppressed++;
+		return;
+	}
+	t.last_us = now;
+	trigger.matched |= 1ULL << i;
+}
+
+// Reap finished hooks, called on SIGCHLD
+static void trigger_reap()
+{
+	for (int i = trigger.hook_count - 1; i >= 0; --i)
+	{
+		if (waitpid(trigger.hook_pids[i], NULL, WNOHANG) != 0)
+			trigger.hook_pids[i] = trigger.hook_pids[--trigger.hook_count];
+	}
+}
+
+// posix_spawn is cheap where fork is not (Cygwin), and nothing is waited for here.
+// msys1 has no posix_spawn, the hook is forked there and reaped the same way.
+// The hook gets its own process group, so signals to the tab don't reach it.
+static void trigger_spawn_hook(const char* pattern)
+{
+	if (trigger.hook_count >= TRIGGER_MAX_HOOKS)
+		trigger_reap();
+	if (trigger.hook_count >= TRIGGER_MAX_HOOKS)
+	{
+		// too many hooks are still running
+		trigger.suppressed++;
+		return;
+	}
+
+	int env_count = 0;
+	while (environ && environ[env_count])
+		env_count++;
+	char** envp = (char**)calloc(env_count + 3, sizeof(char*));
+	char* env_trigger = (char*)malloc(strlen(pattern) + 32);
+	char* env_line = (char*)malloc(trigger.line_len + 32);
+	if (!envp || !env_trigger || !env_line)
+	{
+		free(envp); free(env_trigger); free(env_line);
+		return;
+	}
+	sprintf(env_trigger, "CONNECTOR_TRIGGER=%s", pattern);
+	sprintf(env_line, "CONNECTOR_LINE=%s", trigger.line);
+	int n = 0;
+	for (int i = 0; i < env_count; ++i)
+		if (strncmp(environ[i], "CONNECTOR_TRIGGER=", 18) != 0 && strncmp(environ[i], "CONNECTOR_LINE=", 15) != 0)
+			envp[n++] = environ[i];
+	envp[n++] = env_trigger;
+	envp[n++] = env_line;
+
+	pid_t child = 0;
+	char* argv[] = {(char*)"sh", (char*)"-c", trigger.hook, NULL};
+	#if defined(HAS_FORKPTY)
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	for (int f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+		posix_spawn_file_actions_addopen(&actions, f, "/dev/null", O_RDWR, 0);
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	int rc = posix_spawn(&child, "/bin/sh", &actions, &attr, argv, envp);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	#else
+	child = fork();
+	if (child == 0)
+	{
+		setpgid(0, 0);
+		int null_fd = open("/dev/null", O_RDWR);
+		for (int f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+			dup2(null_fd, f);
+		execve("/bin/sh", argv, envp);
+		_exit(127);
+	}
+	int rc = (child > 0) ? 0 : errno;
+	#endif
+	if (rc == 0)
+	{
+		trigger.hook_pids[trigger.hook_count++] = child;
+		trigger.hooks++;
+	}
+	else if (verbose)
+	{
+		write_verbose("\r\n\033[31;40m{PID:%u} can't start trigger hook: %s\033[m\r\n", getpid(), strerror(rc));
+	}
+
+	free(envp);
+	free(env_trigger);
+	free(env_line);
+}
+
+// Run hooks or prepare the notification for triggers matched on the line
+static void trigger_report()
+{
+	if (!trigger.matched)
+		return;
+	trigger.line[trigger.line_len] = 0;
+	if (trigger.hook)
+	{
+		for (int i = 0; i < trigger.count; ++i)
+		{
+			if (!(trigger.matched & (1ULL << i)))
+				continue;
+			trigger_spawn_hook(trigger.triggers[i].pattern);
+		}
+	}
+	else
+	{
+		// one notification per line, control characters can't be nested into OSC
+		char* line = trigger.line;
+		while (trigger.line_len > 0 && (unsigned char)line[trigger.line_len - 1] <= ' ')
+			line[--trigger.line_len] = 0;
+		for (int n = 0; n < trigger.line_len; ++n)
+			if ((unsigned char)line[n] < 0x20 || line[n] == 0x7F)
+				line[n] = ' ';
+		int len = snprintf(trigger.notify + trigger.notify_len, sizeof(trigger.notify) - trigger.notify_len,
+			"\033]9;trigger: %s\033\\", line);
+		if (len > 0 && trigger.notify_len + len < (int)sizeof(trigger.notify))
+		{
+			trigger.notify_len += len;
+			trigger.notified++;
+		}
+	}
+	trigger.matched = 0;
+}
+
+// Check regex triggers which key was found on the line
+static void trigger_verify()
+{
+	unsigned long long check = (trigger.pending | trigger.anchorless) & ~trigger.fired;
+	if (!check || !trigger.line_len)
+		return;
+	trigger.line[trigger.line_len] = 0;
+	for (int i = 0; i < trigger.count; ++i)
+	{
+		if (!(check & (1ULL << i)))
+			continue;
+		trigger.verified++;
+		if (regexec(&trigger.triggers[i].re, trigger.line, 0, NULL, 0) == 0)
+		{
+			trigger.pending &= ~(1ULL << i);
+			trigger_fire(i);
+		}
+	}
+}
+
+static void trigger_hit(unsigned long long mask)
+{
+	trigger.hits++;
+	mask &= ~trigger.fired;
+	for (int i = 0; mask; ++i, mask >>= 1)
+	{
+		if (!(mask & 1))
+			continue;
+		if (trigger.triggers[i].is_regex)
+			trigger.pending |= 1ULL << i;
+		else
+			trigger_fire(i);
+	}
+}
+
+static void trigger_line_append(const char* ptr, int len)
+{
+	int room = (TRIGGER_LINE_MAX - 1) - trigger.line_len;
+	if (len > room)
+		len = room;
+	if (len > 0)
+	{
+		memcpy(trigger.line + trigger.line_len, ptr, len);
+		trigger.line_len += len;
+	}
+}
+
+static void trigger_line_end()
+{
+	trigger_verify();
+	trigger_report();
+	trigger.line_len = 0;
+	trigger.pending = trigger.fired = 0;
+}
+
+static const char* trigger_skip(const char* p, const char* end)
+{
+	if (trigger.first_count == 1)
+	{
+		const char* next = (const char*)memchr(p, trigger.first_only, end - p);
+		const char* lf = (const char*)memchr(p, '\n', (next ? next : end) - p);
+		return lf ? lf : (next ? next : end);
+	}
+	while (p < end && !trigger.first_byte[(unsigned char)*p] && *p != '\n')
+		++p;
+	return p;
+}
+
+static void trigger_notify()
+{
+	if (trigger.notify_len)
+	{
+		filter_emit_copy(of_Trigger, vt_OSC, trigger.notify, trigger.notify_len);
+		trigger.notify_len = 0;
+	}
+}
+
+// Scan the text until the end of the line with a notification, returns scanned length
+static int trigger_scan(const char* ptr, int len)
+{
+	const unsigned char* p = (const unsigned char*)ptr;
+	const unsigned char* end = p + len;
+	const unsigned char* line_start = p;
+	unsigned short state = trigger.state;
+	while (p < end)
+	{
+		if (state == 0 && trigger.first_count)
+		{
+			p = (const unsigned char*)trigger_skip((const char*)p, (const char*)end);
+			if (p >= end)
+				break;
+		}
+		else if (!trigger.first_count)
+		{
+			// regex triggers without keys only
+			const unsigned char* lf = (const unsigned char*)memchr(p, '\n', end - p);
+			if (!lf)
+				break;
+			p = lf;
+		}
+		unsigned char c = *(p++);
+		if (c == '\n')
+		{
+			trigger_line_append((const char*)line_start, (int)(p - 1 - line_start));
+			trigger_line_end();
+			line_start = p;
+			state = 0;
+			if (trigger.notify_len)
+				break;
+			continue;
+		}
+		state = trigger.delta[state * 256 + c];
+		if (trigger.out[state])
+		{
+			trigger_line_append((const char*)line_start, (int)(p - line_start));
+			line_start = p;
+			trigger_hit(trigger.out[state]);
+		}
+	}
+	if (p >= end)
+		p = end;
+	trigger_line_append((const char*)line_start, (int)(p - line_start));
+	trigger.state = state;
+	trigger.bytes += p - (const unsigned char*)ptr;
+	return (int)(p - (const unsigned char*)ptr);
+}
+
+static bool trigger_process(const VtToken& tok)
+{
+	if (!trigger.enabled || tok.type != vt_Text)
+		return false;
+	if (!trigger.delta)
+		trigger_compile();
+	// notifications follow the line which caused them
+	const char* p = tok.ptr;
+	const char* end = tok.ptr + tok.len;
+	const char* sent = p;
+	while (p < end)
+	{
+		p += trigger_scan(p, (int)(end - p));
+		if (trigger.notify_len)
+		{
+			filter_emit(of_Trigger, tok.type, sent, (int)(p - sent));
+			trigger_notify();
+			sent = p;
+		}
+	}
+	if (sent == tok.ptr)
+		return false;
+	if (sent < end)
+		filter_emit(of_Trigger, tok.type, sent, (int)(end - sent));
+	return true;
+}
+
+// Prompts are not followed by LF, the line is checked when the output went idle.
+// Reads often end in the middle of a line, verifying there would run regexec
+// on every read boundary of a long line.
+static void trigger_idle()
+{
+	if (!trigger.enabled || !trigger.line_len)
+		return;
+	trigger_verify();
+	trigger_report();
+	trigger_notify();
+}
+
+// Progress bars rewrite the same line(s) again and again: `\r` (or cursor up
+// for multi-line displays) then the new text, often with `ESC[K`. Within one read
+// the stage holds two frames, and drops the text of the previous frame when the next
+// one returns to its start and overwrites every line of it (by EL or by longer text).
+// SGR of dropped frames is kept. Anything else (tabs, other sequences) passes as is.
+#define PROGRESS_MAX_LINES 32
+enum ProgressLineFlags
+{
+	pl_Erase = 1,   // EL (CSI K, CSI 0K, CSI 2K) in the line
+	pl_Wide  = 2,   // non-ASCII text, columns are unknown
+};
+struct ProgressFrame
+{
+	VtToken* toks;
+	int count, size;
+	int boundary;           // leading tokens which moved the cursor to the frame start
+	int up;                 // rows the boundary moved up
+	bool col0;              // the frame starts in column 0
+	bool at_col0;           // the cursor is in column 0 after the frame
+	int lines;              // LFs in the frame
+	int width[PROGRESS_MAX_LINES];
+	unsigned char flags[PROGRESS_MAX_LINES];
+	int bytes;              // bytes of the frame except SGR
+};
+struct ProgressSquash
+{
+	bool enabled;           // `--no-squash` disables the stage
+	bool col0;              // the cursor was in column 0 after the last read
+	ProgressFrame frames[2];
+	ProgressFrame *prev, *cur;
+	unsigned long long squashed, bytes_elided;
+};
+static ProgressSquash progress = {true};
+
+static void progress_reset(ProgressFrame* f, bool col0)
+{
+	f->count = f->boundary = f->up = f->lines = f->bytes = 0;
+	f->col0 = f->at_col0 = col0;
+	memset(f->width, 0, sizeof(f->width));
+	memset(f->flags, 0, sizeof(f->flags));
+}
+
+static void progress_append(ProgressFrame* f, VtTokenType type, const char* ptr, int len)
+{
+	if (f->count == f->size)
+	{
+		int new_size = _max(f->size * 2, 256);
+		VtToken* new_toks = (VtToken*)realloc(f->toks, new_size * sizeof(VtToken));
+		if (!new_toks)
+			return;
+		f->toks = new_toks;
+		f->size = new_size;
+	}
+	VtToken& tok = f->toks[f->count++];
+	tok.type = type;
+	tok.ptr = ptr;
+	tok.len = len;
+}
+
+static bool progress_is_sgr(const VtToken& tok)
+{
+	return tok.type == vt_CSI && tok.ptr[tok.len - 1] == 'm';
+}
+
+static void progress_emit(ProgressFrame* f)
+{
+	for (int i = 0; i < f->count; ++i)
+		filter_emit(of_Progress, f->toks[i].type, f->toks[i].ptr, f->toks[i].len);
+	f->count = 0;
+}
+
+// `cur` returns to the start of `prev` and overwrites all its lines
+static bool progress_covers(const ProgressFrame* prev, const ProgressFrame* cur)
+{
+	if (!prev->col0 || !cur->col0 || cur->up != prev->lines || prev->count == prev->boundary)
+		return false;
+	// LFs of the very first drawing may scroll the screen, only redraws are dropped
+	if (prev->lines && prev->up != prev->lines)
+		return false;
+	for (int j = 0; j <= prev->lines; ++j)
+	{
+		if (prev->width[j] >= term_columns)
+			return false; // wrapped line
+		if (j > cur->lines)
+		{
+			if (prev->width[j] || prev->flags[j])
+				return false;
+			continue;
+		}
+		if (cur->width[j] >= term_columns)
+			return false;
+		if (cur->flags[j] & pl_Erase)
+			continue;
+		if ((prev->flags[j] & (pl_Erase|pl_Wide)) || cur->width[j] < prev->width[j])
+			return false;
+	}
+	return true;
+}
+
+// `cur` frame is finished: squash it with `prev` or pass `prev` to the host
+static void progress_finish()
+{
+	ProgressFrame* prev = progress.prev;
+	ProgressFrame* cur = progress.cur;
+	if (prev->count && progress_covers(prev, cur))
+	{
+		// keep boundary and SGR of prev, then the content of cur
+		int kept = prev->boundary;
+		for (int i = prev->boundary; i < prev->count; ++i)
+			if (progress_is_sgr(prev->toks[i]))
+				prev->toks[kept++] = prev->toks[i];
+		progress.bytes_elided += prev->bytes;
+		for (int i = 0; i < cur->boundary; ++i)
+			progress.bytes_elided += cur->toks[i].len;
+		prev->count = kept;
+		for (int i = cur->boundary; i < cur->count; ++i)
+			progress_append(prev, cur->toks[i].type, cur->toks[i].ptr, cur->toks[i].len);
+		prev->lines = cur->lines;
+		prev->at_col0 = cur->at_col0;
+		prev->bytes = cur->bytes;
+		memcpy(prev->width, cur->width, sizeof(prev->width));
+		memcpy(prev->flags, cur->flags, sizeof(prev->flags));
+		progress.squashed++;
+		cur->count = 0;
+		return;
+	}
+	progress_emit(prev);
+	progress.prev = cur;
+	progress.cur = prev;
+}
+
+// Pass all held frames, `col0` is known position of the cursor after them
+static void progress_flush()
+{
+	if (!progress.prev)
+		return;
+	progress_finish();
+	progress_emit(progress.prev);
+	progress_emit(progress.cur);
+	progress_reset(progress.prev, false);
+	progress_reset(progress.cur, progress.col0);
+}
+
+// The cursor returns: `\r` (up=0), CSI A (col0 is not changed) or CSI F
+static void progress_boundary(VtTokenType type, const char* ptr, int len, int up, bool cr)
+{
+	ProgressFrame* cur = progress.cur;
+	if (cur->count > cur->boundary)
+	{
+		bool at_col0 = cur->at_col0;
+		progress_finish();
+		cur = progress.cur;
+		progress_reset(cur, at_col0);
+	}
+	progress_append(cur, type, ptr, len);
+	cur->boundary = cur->count;
+	cur->up += up;
+	if (cr)
+		cur->col0 = true;
+	cur->at_col0 = cur->col0;
+}
+
+static void progress_opaque(const VtToken& tok)
+{
+	progress_flush();
+	filter_emit(of_Progress, tok.type, tok.ptr, tok.len);
+	progress.col0 = false;
+	progress_reset(progress.cur, false);
+}
+
+static void progress_text(const VtToken& tok)
+{
+	const char* p = tok.ptr;
+	const char* end = tok.ptr + tok.len;
+	while (p < end)
+	{
+		ProgressFrame* cur = progress.cur;
+		const char* lf = p;
+		while (lf < end && *lf == '\r')
+			++lf;
+		if (*p == '\r' && !(lf < end && *lf == '\n'))
+		{
+			progress_boundary(vt_Text, p, 1, 0, true);
+			++p;
+		}
+		else if (*p == '\r' || *p == '\n')
+		{
+			// "\r\n" ("\r\r\n" after ONLCR) or LF in column 0 starts the next line of the frame
+			int len = (int)(lf - p) + 1;
+			if ((*p == '\n' && !cur->at_col0) || cur->lines + 1 >= PROGRESS_MAX_LINES)
+			{
+				VtToken lf = {vt_Text, p, len};
+				progress_opaque(lf);
+			}
+			else
+			{
+				progress_append(cur, vt_Text, p, len);
+				cur->lines++;
+				cur->bytes += len;
+				cur->at_col0 = true;
+			}
+			p += len;
+		}
+		else if ((unsigned char)*p < 0x20 || *p == 0x7F)
+		{
+			VtToken ctrl = {vt_Text, p, 1};
+			progress_opaque(ctrl);
+			++p;
+		}
+		else
+		{
+			const char* run = p;
+			bool wide = false;
+			int columns = 0;
+			for (; p < end && ((unsigned char)*p >= 0x20 && *p != 0x7F); ++p)
+			{
+				if ((unsigned char)*p >= 0x80)
+					wide = true;
+				else
+					++columns;
+			}
+			progress_append(cur, vt_Text, run, p - run);
+			cur->width[cur->lines] += columns;
+			if (wide)
+				cur->flags[cur->lines] |= pl_Wide;
+			cur->bytes += p - run;
+			cur->at_col0 = false;
+		}
+	}
+}
+
+static bool progress_process(const VtToken& tok)
+{
+	if (!progress.enabled)
+		return false;
+	if (!progress.prev)
+	{
+		progress.prev = &progress.frames[0];
+		progress.cur = &progress.frames[1];
+		progress_reset(progress.prev, false);
+		progress_reset(progress.cur, progress.col0);
+	}
+
+	// split sequences are stored in the scanner buffer, it may be reused
+	if (!out_batch_begin || tok.ptr < out_batch_begin || tok.ptr + tok.len > out_batch_end)
+	{
+		progress_opaque(tok);
+		return true;
+	}
+
+	if (tok.type == vt_Text)
+	{
+		progress_text(tok);
+		return true;
+	}
+
+	if (tok.type == vt_CSI && !vt_csi_intermediate(tok))
+	{
+		char prefix, final;
+		int params[4] = {};
+		int count = vt_csi_params(tok, prefix, params, 4, final);
+		ProgressFrame* cur = progress.cur;
+		if (!prefix && final == 'm')
+		{
+			progress_append(cur, tok.type, tok.ptr, tok.len);
+			return true;
+		}
+		if (!prefix && final == 'K' && count <= 1 && (params[0] == 0 || params[0] == 2))
+		{
+			progress_append(cur, tok.type, tok.ptr, tok.len);
+			cur->flags[cur->lines] |= pl_Erase;
+			cur->bytes += tok.len;
+			return true;
+		}
+		if (!prefix && (final == 'A' || final == 'F') && count <= 1)
+		{
+			progress_boundary(tok.type, tok.ptr, tok.len, (count && params[0]) ? params[0] : 1, final == 'F');
+			return true;
+		}
+	}
+
+	progress_opaque(tok);
+	return true;
+}
+
+// The read is processed, pass the held frames
+static void progress_batch_end()
+{
+	if (!progress.enabled || !progress.prev)
+		return;
+	progress.col0 = progress.cur->at_col0;
+	progress_flush();
+}
+
+// Predictive local echo for slow backends, switch `--predict-echo`.
+// Printable keys are shown underlined at once, before the shell echoes them.
+// When the real output comes, the cursor is moved back (CUB) and the predicted
+// cells are erased (ECH), so the echo is drawn over them in the proper rendition.
+// DECSC/DECRC are not used, the application may keep its own cursor there.
+// The cursor column is followed in the output, predictions are shown only
+// when it's known and they fit into the line, CUB does not cross lines.
+// In canonical mode with ECHO the tty driver echoes keys, predictions are shown
+// immediately. In raw mode (readline) they are shown after `predict_confirm_min`
+// keys of the line were echoed as predicted. Wrong or late echo stops the predictions.
+#define PREDICT_MAX 32
+struct PredictedKey
+{
+	char ch;
+	bool shown;             // drawn now
+	long long time_us;      // when the key was typed
+	long long shown_us;     // when it was drawn first time, 0 if never
+};
+struct PredictEcho
+{
+	bool enabled;
+	bool trusted;           // show new predictions
+	bool blocked;           // non-printable key was typed, wait until the queue is drained
+	int streak;             // keys confirmed after the last Enter or misprediction
+	PredictedKey keys[PREDICT_MAX];
+	int count, shown;
+	int column;             // cursor column of the output, -1 if unknown
+	long long echo_us;      // when the last predicted key was echoed
+	unsigned predicted, displayed, confirmed, mispredicted, expired;
+	unsigned saved_keys;    // shown keys which were confirmed
+	long long saved_us;     // sum of (echo time - drawn time) of them
+};
+static PredictEcho predict = {false, false, false, 0, {}, 0, 0, -1};
+const int predict_confirm_min = 3;
+const long long predict_timeout_us = 1000000;
+
+static void predict_erase()
+{
+	if (predict.shown)
+	{
+		char seq[32];
+		int len = sprintf(seq, "\033[%iD\033[%iX", predict.shown, predict.shown);
+		write_console(seq, len);
+	}
+}
+
+// The next predicted key can be drawn and erased in the current line
+static bool predict_fits()
+{
+	return predict.column >= 0 && (predict.column + predict.shown + 1) < term_columns;
+}
+
+// Follow the cursor column in the pty output, sequences which may move the
+// cursor in unknown way (DECRC, SCORC, ...) make it unknown until CR
+static void predict_track(const VtToken& tok)
+{
+	if (tok.type == vt_Text)
+	{
+		for (int i = 0; i < tok.len; ++i)
+		{
+			unsigned char c = tok.ptr[i];
+			if (c == '\r')
+				predict.column = 0;
+			else if (predict.column < 0)
+				continue;
+			else if (c == '\b')
+				predict.column = _max(predict.column - 1, 0);
+			else if (c == '\t')
+				predict.column = _min((predict.column / 8 + 1) * 8, term_columns - 1);
+			else if (c >= 0x20 && c != 0x7F && (c < 0x80 || c >= 0xC0))
+				predict.column = (predict.column + 1 < term_columns) ? (predict.column + 1) : -1; // wrap
+		}
+		return;
+	}
+	if (tok.type == vt_Esc && tok.len == 2)
+	{
+		if (tok.ptr[1] == '8')
+			predict.column = -1;  // DECRC
+		else if (tok.ptr[1] == 'E' || tok.ptr[1] == 'c')
+			predict.column = 0;   // NEL, RIS
+		return;
+	}
+	if (tok.type != vt_CSI)
+		return;
+	char prefix, final;
+	int params[4] = {};
+	int count = vt_csi_params(tok, prefix, params, 4, final);
+	if (prefix || vt_csi_intermediate(tok))
+		return; // modes and queries
+	int n = (count > 0 && params[0] > 0) ? params[0] : 1;
+	switch (final)
+	{
+	case 'G': case '`':  // CHA, HPA
+		predict.column = _min(n, term_columns) - 1;
+		break;
+	case 'H': case 'f':  // CUP
+		predict.column = _min((count > 1 && params[1] > 0) ? params[1] : 1, term_columns) - 1;
+		break;
+	case 'C': case 'a':  // CUF, HPR
+		if (predict.column >= 0)
+			predict.column = _min(predict.column + n, term_columns - 1);
+		break;
+	case 'D':            // CUB
+		if (predict.column >= 0)
+			predict.column = _max(predict.column - n, 0);
+		break;
+	case 'E': case 'F':  // CNL, CPL
+	case 'r':            // DECSTBM homes the cursor
+		predict.column = 0;
+		break;
+	case 'A': case 'B': case 'J': case 'K': case 'X': case 'P': case '@':
+	case 'S': case 'T': case 'm': case 'n': case 'c': case 'h': case 'l': case 's': case 't':
+		break;               // the column is kept
+	default:
+		predict.column = -1;
+	}
+}
+
+static void predict_show(PredictedKey& key)
+{
+	char seq[16];
+	int len = sprintf(seq, "\033[4m%c\033[24m", key.ch);
+	write_console(seq, len);
+	key.shown = true;
+	predict.shown++;
+	if (!key.shown_us)
+	{
+		key.shown_us = get_time_us();
+		predict.displayed++;
+	}
+}
+
+static void predict_reset(bool trusted)
+{
+	predict.count = predict.shown = 0;
+	predict.blocked = false;
+	predict.trusted = trusted;
+	if (!trusted)
+		predict.streak = 0;
+}
+
+static void predict_key(const char* s, int len)
+{
+	if (!predict.enabled)
+		return;
+	if (pty_fd < 0 || (term_modes & tm_AltScreen) || sync_output.holding)
+	{
+		predict.blocked = (predict.count > 0);
+		return;
+	}
+	bool printable = (len == 1 && s[0] >= 0x20 && s[0] < 0x7F);
+	if (!printable)
+	{
+		// cursor movements, editing or Enter, the next line is verified again
+		predict.blocked = (predict.count > 0);
+		predict.trusted = false;
+		predict.streak = 0;
+		return;
+	}
+	if (predict.blocked || predict.count >= PREDICT_MAX)
+		return;
+
+	struct termios attr = {};
+	if (tcgetattr(pty_fd, &attr) == 0)
+	{
+		if ((attr.c_lflag & ICANON) && !(attr.c_lflag & ECHO))
+		{
+			// password prompt
+			predict_erase();
+			predict_reset(false);
+			return;
+		}
+		if (attr.c_lflag & ICANON)
+			predict.trusted = true;  // the tty driver echoes the keys
+	}
+
+	PredictedKey& key = predict.keys[predict.count++];
+	key.ch = s[0];
+	key.shown = false;
+	key.time_us = get_time_us();
+	key.shown_us = 0;
+	predict.predicted++;
+	// shown keys are always the head of the queue
+	if (predict.trusted && predict.shown == predict.count - 1 && predict_fits())
+		predict_show(key);
+}
+
+// Compare the pty output with predicted keys, before the output is passed to host
+static void predict_output(const char* buf, int len)
+{
+	if (!predict.count)
+		return;
+	predict_erase();
+
+	int matched = 0;
+	while (matched < predict.count && matched < len && buf[matched] == predict.keys[matched].ch)
+		++matched;
+	if (matched < len && matched < predict.count)
+	{
+		predict.mispredicted++;
+		predict_reset(false);
+		return;
+	}
+
+	long long now = get_time_us();
+	for (int i = 0; i < matched; ++i)
+	{
+		if (predict.keys[i].shown_us)
+		{
+			predict.saved_keys++;
+			predict.saved_us += now - predict.keys[i].shown_us;
+		}
+	}
+	predict.confirmed += matched;
+	predict.streak += matched;
+	if (matched)
+		predict.echo_us = now;
+	if (predict.streak >= predict_confirm_min)
+		predict.trusted = true;
+
+	predict.count -= matched;
+	memmove(predict.keys, predict.keys + matched, predict.count * sizeof(predict.keys[0]));
+	predict.shown = 0;
+	for (int i = 0; i < predict.count; ++i)
+		predict.keys[i].shown = false;
+	if (!predict.count)
+		predict.blocked = false;
+}
+
+// Keys which are not echoed yet are shown again after the output
+static void predict_redisplay()
+{
+	if (!predict.trusted || !predict.count || predict.shown)
+		return;
+	for (int i = 0; i < predict.count && predict_fits(); ++i)
+		predict_show(predict.keys[i]);
+}
+
+static void predict_check_timeout()
+{
+	// the shell may be behind the typing, only the echo which stopped is late
+	if (predict.count && (get_time_us() - _max(predict.keys[0].time_us, predict.echo_us)) > predict_timeout_us)
+	{
+		predict_erase();
+		predict.expired++;
+		predict_reset(false);
+	}
+}
+
+#define OUT_FILTER_MAX 16
+struct OutputFilter
+{
+	const char* name;
+	bool* enabled;                      // switch of the stage, NULL if it's always on
+	bool (*token)(const VtToken& tok);  // returns true if the token was consumed
+	void (*batch_end)();                // optional, the read from pty is processed
+	void (*idle)();                     // optional, no output for a while
+	ConnectorFilterParm* plugin;        // loaded by `--filter`, NULL for built-in stages
+};
+static OutputFilter out_filters[OUT_FILTER_MAX] = {
+	{"modes", NULL, modes_process},
+	{"query", &queries.enabled, query_process},
+	{"trigger", &trigger.enabled, trigger_process, NULL, trigger_idle},
+	{"command", &cmd_timing.enabled, cmd_process},
+	{"background", &background.hidden, background_process},
+	{"progress", &progress.enabled, progress_process, progress_batch_end},
+	{"sgr", &sgr_min.enabled, sgr_process, NULL, sgr_flush},
+	{"cwd", &cwd_tracker.enabled, cwd_process},
+	{"sync", &sync_output.enabled, sync_process, NULL, sync_check_timeout},
+};
+static int out_filter_count = of_Builtin;
+
+// Disabled stages are not called at all, so the chain of
+// disabled stages costs as much as one out_emit
+static const OutputFilter* out_active[OUT_FILTER_MAX];
+static int out_active_count = -1;                   // -1 until the chain is built
+static int out_active_from[OUT_FILTER_MAX + 1];     // stage index -> first position in out_active
+
+static void filter_chain_update()
+{
+	out_active_count = 0;
+	for (int i = 0; i < out_filter_count; ++i)
+	{
+		out_active_from[i] = out_active_count;
+		if (!out_filters[i].enabled || *out_filters[i].enabled)
+			out_active[out_active_count++] = &out_filters[i];
+	}
+	out_active_from[out_filter_count] = out_active_count;
+}
+
+static void filter_pass(int stage, const VtToken& tok)
+{
+	for (int i = out_active_from[stage]; i < out_active_count; ++i)
+	{
+		const OutputFilter& f = *out_active[i];
+		if (f.plugin)
+		{
+			if (f.plugin->Token(f.plugin->pContext, (ConnectorTokenType)tok.type, tok.ptr, tok.len))
+				return;
+		}
+		else if (f.token(tok))
+		{
+			return;
+		}
+	}
+	out_emit(tok.ptr, tok.len);
+}
+
+static void filter_batch_end()
+{
+	for (int i = 0; i < out_active_count; ++i)
+	{
+		const OutputFilter& f = *out_active[i];
+		if (f.plugin && f.plugin->BatchEnd)
+			f.plugin->BatchEnd(f.plugin->pContext);
+		else if (f.batch_end)
+			f.batch_end();
+	}
+}
+
+static void filter_idle()
+{
+	for (int i = 0; i < out_active_count; ++i)
+	{
+		const OutputFilter& f = *out_active[i];
+		if (f.plugin && f.plugin->Idle)
+			f.plugin->Idle(f.plugin->pContext);
+		else if (f.idle)
+			f.idle();
+	}
+}
+
+// ConnectorFilterParm::Emit
+static void WINAPI filter_plugin_emit(void* chain, ConnectorTokenType type, LPCSTR data, int len)
+{
+	int stage = (int)((OutputFilter*)chain - out_filters);
+	if (len <= 0 || stage < 0 || stage >= out_filter_count)
+		return;
+	if (out_batch_begin && data >= out_batch_begin && data + len <= out_batch_end)
+		filter_emit(stage, (VtTokenType)type, data, len);
+	else
+		filter_emit_copy(stage, (VtTokenType)type, data, len);
+}
+
+// switch `--filter <library>[,arg]`
+static bool load_filter(const char* spec)
+{
+	if (out_filter_count >= OUT_FILTER_MAX)
+	{
+		printf("{PID:%u} too many filters\r\n", getpid());
+		return false;
+	}
+	char* path = strdup(spec);
+	char* arg = strrchr(path, ',');
+	if (arg)
+		*(arg++) = 0;
+
+	OutputFilter& f = out_filters[out_filter_count];
+	ConnectorFilterParm* parm = (ConnectorFilterParm*)calloc(1, sizeof(*parm));
+	parm->cbSize = sizeof(*parm);
+	parm->pszArg = arg;
+	parm->pChain = &f;
+	parm->Emit = filter_plugin_emit;
+
+	void* lib = dlopen(path, RTLD_NOW);
+	ConnectorFilterInit_t init = lib ? (ConnectorFilterInit_t)dlsym(lib, "ConnectorFilterInit") : NULL;
+	if (!init)
+	{
+		printf("{PID:%u} can't load filter `%s`: %s\r\n", getpid(), path, dlerror());
+	}
+	else if (init(parm) != 0 || !parm->Token)
+	{
+		printf("{PID:%u} filter `%s` failed to initialize\r\n", getpid(), path);
+	}
+	else
+	{
+		f.name = parm->pszName ? parm->pszName : path;
+		f.plugin = parm;
+		out_filter_count++;
+		return true;
+	}
+
+	if (lib)
+		dlclose(lib);
+	free(parm);
+	free(path);
+	return false;
+}
+
+// Output of pty passes here, before the host
+// Strings longer than VT_SEQ_MAX (sixel and inline images, OSC 52 clipboard) are not
+// buffered, the scanner passes them as vt_Raw parts of the read buffer, so memory use
+// does not depend on the payload size. Payloads are passed whole by default, switch
+// `--max-payload <KB>` limits the size passed to the host, the rest is dropped and
+// the string is terminated with ST, so the host parser is not left inside it.
+struct PayloadLimit
+{
+	long long limit;                // bytes, 0 if unlimited
+	bool dropping;                  // the current payload exceeded the limit
+	unsigned count, dropped;
+	unsigned long long bytes, dropped_bytes;
+	long long max;
+};
+static PayloadLimit payload = {0};
+
+// Returns false if the part of too long sequence must not be passed
+static bool payload_pass(const VtToken& tok)
+{
+	if (!out_scanner.raw)
+		return true; // unfinished sequence flushed on idle
+	bool first = (out_scanner.raw_len == tok.len);
+	bool last = (out_scanner.state == vs_Ground);
+	if (first)
+	{
+		payload.count++;
+		payload.dropping = false;
+	}
+	payload.bytes += tok.len;
+	if (last)
+		payload.max = _max(payload.max, out_scanner.raw_len);
+	if (payload.dropping)
+	{
+		payload.dropped_bytes += tok.len;
+		return false;
+	}
+	if (!payload.limit || out_scanner.raw_len <= payload.limit)
+		return true;
+
+	int keep = tok.len - (int)(out_scanner.raw_len - payload.limit);
+	if (keep > 0)
+	{
+		VtToken head = {vt_Raw, tok.ptr, keep};
+		filter_pass(0, head);
+	}
+	VtToken st = {vt_Raw, "\033\\", 2};
+	filter_pass(0, st);
+	payload.dropped++;
+	payload.dropped_bytes += tok.len - _max(keep, 0);
+	payload.dropping = !last;
+	if (verbose)
+		write_verbose("\r\n\033[31;40m{PID:%u} escape sequence exceeds %lld bytes, the rest is dropped\033[m\r\n",
+			getpid(), payload.limit);
+	return false;
+}
+
+static void write_output(const char* buf, int len, WriteProcessedStream strm)
+{
+	out_stream = strm;
+	if (out_active_count < 0)
+		filter_chain_update();
+	if (predict.count)
+		predict_output(buf, len);
+	const char* p = buf;
+	const char* end = buf + len;
+	VtToken tok;
+	out_batch_begin = buf;
+	out_batch_end = end;
+	while (vt_next(out_scanner, p, end, tok))
+	{
+		if (predict.enabled)
+			predict_track(tok);
+		if (tok.type != vt_Raw || payload_pass(tok))
+			filter_pass(0, tok);
+	}
+	filter_batch_end();
+	out_flush();
+	out_batch_begin = out_batch_end = NULL;
+	if (predict.count)
+		predict_redisplay();
+}
+
+// Called when there was no output for a while
+static void output_idle()
+{
+	VtToken tok;
+	if (out_active_count < 0)
+		filter_chain_update();
+	if (vt_flush(out_scanner, tok))
+		filter_pass(0, tok);
+	filter_idle();
+	out_flush();
+	predict_check_timeout();
+}
+
+// Hidden tab, see BackgroundMode
+static void background_hide()
+{
+	out_flush();
+	background.hidden = true;
+	background.since_us = get_time_us();
+	background.hides++;
+	replay_reset();
+	out_active_count = -1;
+	if (verbose)
+		write_verbose("\r\n\033[32;40m{PID:%u} tab is hidden, output is kept\033[m\r\n", getpid());
+}
+
+static void background_show()
+{
+	background.hidden = false;
+	background.hidden_us += get_time_us() - background.since_us;
+	out_active_count = -1;
+	background_repaint();
+}
+
+// Called in the pump loop, the host may not support the visibility
+static void background_check()
+{
+	if (!background.enabled || !Connector.IsTabVisible)
+		return;
+	bool hidden = !Connector.IsTabVisible();
+	if (hidden == background.hidden)
+		return;
+	if (hidden)
+		background_hide();
+	else
+		background_show();
+}
+
+static int process_pty(int& pty, char* buf, const int bufCount, const int preferredCount)
+{
+	debug_log_format("%u:PID=%u:TID=%u: calling read(%i)\n", GetTickCount(), getpid(), GetCurrentThreadId(), pty);
+	long long trace_us = trace_begin();
+	int len = read(pty, buf, bufCount);
+	trace_end("read", trace_us, len);
+	pump_stats.reads++;
+
+	if (len > 0)
+	{
+		// Small read shortly after our input is the interactive echo,
+		// don't try to coalesce it with following output
+		bool echo = echo_pending();
+		bool drained = (len < bufCount);
+		if (!echo || len > echo_max_len)
+		{
+			while ((len+4) < preferredCount)
+			{
+				trace_us = trace_begin();
+				int addLen = read(pty, buf+len, bufCount-len);
+				trace_end("read", trace_us, addLen);
+				pump_stats.reads++;
+				if (addLen <= 0)
+				{
+					drained = true;
+					break;
+				}
+				len += addLen;
+			}
+		}
+		buf[len] = 0;
+		pump_stats.read_bytes += len;
+		write_output(buf, len, (pty == pty_err) ? wps_Error : wps_Output);
+		if (echo && drained)
+			echo_received();
+	}
+	else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		// pty_fd is non-blocking, nothing to read yet
+		len = 0;
+	}
+	else
+	{
+		if (verbose)
+		{
+			write_verbose("\r\n\033[31;40m{PID:%u} read(pty=%i) failed (len=%i,errno=%i): %s\033[m\r\n", getpid(), pty, len, errno, strerror(errno));
+			check_child();
+		}
+		pty = -1;
+	}
+
+	return len;
+}
+
+// Client of the detached session: output and exit status come from the holder
+static int process_session()
+{
+	int len = sess_fill(session_link);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	int rc = 0;
+	if (len > 0)
+	{
+		pump_stats.reads++;
+		char type; const char* data; int data_len;
+		while ((rc = sess_next(session_link, type, data, data_len)) > 0)
+		{
+			switch (type)
+			{
+			case sf_Data:
+				pump_stats.read_bytes += data_len;
+				write_output(data, data_len, wps_Output);
+				break;
+			case sf_Exit:
+				if (data_len >= 4)
+					child_status = lz4_read32((const unsigned char*)data);
+				break;
+			case sf_Error:
+				write_verbose("\r\n\033[30;41m\033[K{PID:%u} session refused: %.*s\033[m\r\n", getpid(), data_len, data);
+				break;
+			}
+		}
+	}
+
+	if (len <= 0 || rc < 0)
+	{
+		if (verbose)
+			write_verbose("\r\n\033[31;40m{PID:%u} session link closed (len=%i,rc=%i)\033[m\r\n", getpid(), len, rc);
+		safe_close(session_link.fd);
+		return -1;
+	}
+	return len;
+}
+
+enum ExitPolicy
+{
+	ep_Shell,    // tear down as soon as the shell exits (default)
+	ep_Session,  // tear down when no processes are left in the shell's session
+	ep_Pty,      // wait until pty is closed by all processes
+};
+static ExitPolicy exit_policy = ep_Shell;
+
+static void sigchld(int sig)
+{
+	int e = errno;
+	if (sigchld_pipe[1] >= 0)
+		write(sigchld_pipe[1], "C", 1);
+	errno = e;
+}
+
+static void watch_child()
+{
+	if (sigchld_pipe[0] < 0)
+	{
+		if (pipe(sigchld_pipe) != 0)
+		{
+			sigchld_pipe[0] = sigchld_pipe[1] = -1;
+			return;
+		}
+		for (int i = 0; i <= 1; ++i)
+		{
+			fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+			fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+	session_id = pid;
+	child_status = -1;
+	signal(SIGCHLD, sigchld);
+	// the shell could exit before the handler was installed
+	check_child();
+}
+
+static bool proc_read_stat(const char* pid_name, pid_t& sid, unsigned long long& ticks, long& rss_pages, char* comm, int comm_max, char* state = NULL);
+
+// Is any process of the shell's session left? Background jobs run in their
+// own process groups, so /proc is scanned for the session id, 10 times per second at most
+static bool session_alive()
+{
+	static long long last_us = 0;
+	static bool alive = true;
+	long long now = get_time_us();
+	if (last_us && (now - last_us) < 100000)
+		return alive;
+	last_us = now;
+
+	DIR* dir = opendir("/proc");
+	if (!dir)
+	{
+		// No /proc, the shell's process group is the best we can check
+		alive = !((kill(-session_id, 0) == -1) && (errno == ESRCH));
+		return alive;
+	}
+	alive = false;
+	struct dirent* ent;
+	while (!alive && (ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] < '1' || ent->d_name[0] > '9')
+			continue;
+		pid_t sid = 0;
+		unsigned long long ticks = 0;
+		long rss_pages = 0;
+		char comm[64], state = 0;
+		// zombies are not reaped yet, but they are gone already
+		if (proc_read_stat(ent->d_name, sid, ticks, rss_pages, comm, sizeof(comm), &state) && sid == session_id && state != 'Z')
+			alive = true;
+	}
+	closedir(dir);
+	return alive;
+}
+
+static bool session_finished()
+{
+	if (pid > 0 || session_id <= 0)
+		return false;
+	switch (exit_policy)
+	{
+	case ep_Shell:
+		return true;
+	case ep_Session:
+		return !session_alive();
+	default:
+		return false;
+	}
+}
+
+// The pty is gone: close when the shell was reaped, or with `session`
+// policy when its last process is gone too
+static bool session_closed()
+{
+	if (pid > 0 && check_child() != -1)
+		return false;
+	return (exit_policy != ep_Session) || (session_id <= 0) || !session_alive();
+}
+
+static int check_child(bool force_print /*= false*/)
+{
+	if (pid <= 0)
+		return -1;
+
+	int status = 0, wait_rc;
+	long long trace_us = trace_begin();
+
+	debug_log_format("%u:PID=%u:TID=%u: calling waitpid(%i)\n", GetTickCount(), getpid(), GetCurrentThreadId(), pid);
+	wait_rc = waitpid(pid, &status, WNOHANG);
+	debug_log_format("%u:PID=%u:TID=%u: waitpid(%i) done rc=%u status=0x%X\n", GetTickCount(), getpid(), GetCurrentThreadId(), pid, wait_rc, status);
+
+	if (wait_rc == pid)
+	{
+		child_status = status;
+
+		if (verbose || force_print || show_stats)
+		{
+			if (WIFEXITED(status))
+				write_verbose("\r\n\033[31;40m{PID:%u} pid=%i was terminated, exitcode=%u", getpid(), pid, WEXITSTATUS(status), strerror(WEXITSTATUS(status)));
+			else if (WIFSIGNALED(status))
+				write_verbose("\r\n\033[31;40m{PID:%u} pid=%i was terminated by signal (%u): %s", getpid(), pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+			else
+				write_verbose("\r\n\033[31;40m{PID:%u} pid=%i was terminated, status=%i\033[m\r\n", getpid(), pid, status);
+		}
+
+		pid = -2;
+	}
+	else if (wait_rc == 0)
+	{
+		// One or more child(ren) exist
+		if (force_print)
+		{
+			write_verbose("\r\n\033[31;40m{PID:%u} one or more children with pid=%i are alive\033[m\r\n", getpid(), pid);
+		}
+	}
+	else if (verbose || force_print)
+	{
+		write_verbose("\r\n\033[31;40m{PID:%u} waitpid(%i) failed (%i): %s", getpid(), pid, errno, strerror(errno));
+	}
+
+	trace_end("check_child", trace_us, wait_rc);
+	return (pid <= 0) ? -1 : 0;
+}
+
+// Pass the shell exit code to our caller
+static int child_exit_code()
+{
+	if (child_status != -1)
+	{
+		if (WIFEXITED(child_status))
+			return WEXITSTATUS(child_status);
+		if (WIFSIGNALED(child_status))
+			return 128 + WTERMSIG(child_status);
+	}
+	return 0;
+}
+
+// Resources used by the shell and its descendants, switch `--proc-monitor [sec]`.
+// Every few seconds a background thread reads /proc/PID/stat of all processes
+// and sums processes of the shell session. The CPU time of every process is
+// accumulated as deltas between samples, so processes which exited are still
+// counted. A process which keeps a CPU busy for `proc_runaway_samples` samples
+// in a row is reported once as runaway, the pump prints the report.
+#define PROC_MAX_TRACKED 256
+#define PROC_MAX_REPORTS 8
+struct ProcSample
+{
+	pid_t pid;
+	unsigned long long cpu_ticks;   // utime+stime
+	unsigned hot;                   // consecutive samples with high CPU load
+	bool seen;                      // cpu_ticks is from the previous sample
+	bool flagged;
+	bool alive;
+};
+struct ProcRunaway
+{
+	pid_t pid;
+	char comm[64];
+	unsigned long long cpu_ticks;
+};
+struct ProcMonitor
+{
+	long long interval_us;          // 0 if the monitor is off
+	long long last_us;
+	pthread_t thread;
+	pid_t thread_pid;               // the thread does not exist in forked children
+	bool stop;
+	pthread_mutex_t mutex;          // guards the fields below
+	pthread_cond_t cond;
+	ProcSample procs[PROC_MAX_TRACKED];  // used by the thread only
+	int count;
+	unsigned samples, runaway;
+	unsigned cur_count, max_count;
+	unsigned long cur_rss_kb, max_rss_kb;
+	unsigned long long cpu_ticks;   // sum of deltas of all processes since start
+	ProcRunaway reports[PROC_MAX_REPORTS];  // not printed yet
+	int report_count;
+	long long sample_us;            // start and duration of the last sample for the trace
+	int sample_dur_us;
+	unsigned traced;                // samples passed to the trace
+};
+static ProcMonitor proc_monitor = {0, 0, 0, 0, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+const unsigned proc_runaway_samples = 3;
+const int proc_runaway_percent = 90;
+
+// Parse "pid (comm) state ppid pgrp session ... utime stime ... rss" of /proc/PID/stat
+static bool proc_read_stat(const char* pid_name, pid_t& sid, unsigned long long& ticks, long& rss_pages, char* comm, int comm_max, char* state /*= NULL*/)
+{
+	char path[64], buf[1024];
+	snprintf(path, sizeof(path), "/proc/%s/stat", pid_name);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	int len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = 0;
+
+	// comm may contain spaces and parentheses
+	char* open_paren = strchr(buf, '(');
+	char* close_paren = strrchr(buf, ')');
+	if (!open_paren || !close_paren || close_paren < open_paren)
+		return false;
+	int comm_len = _min((int)(close_paren - open_paren - 1), comm_max - 1);
+	memcpy(comm, open_paren + 1, comm_len);
+	comm[comm_len] = 0;
+
+	// fields after comm: 3 state, 4 ppid, 5 pgrp, 6 session, ... 14 utime, 15 stime, ... 24 rss
+	unsigned long long fields[25] = {};
+	char* p = close_paren + 1;
+	for (int field = 3; field <= 24 && *p; ++field)
+	{
+		while (*p == ' ')
+			++p;
+		fields[field] = strtoull(p, &p, 10);
+		while (*p && *p != ' ')
+			++p;
+	}
+	if (state)
+		*state = (close_paren[1] == ' ') ? close_paren[2] : 0;
+	sid = (pid_t)fields[6];
+	ticks = fields[14] + fields[15];
+	rss_pages = (long)fields[24];
+	return true;
+}
+
+static ProcSample* proc_find(pid_t pid)
+{
+	for (int i = 0; i < proc_monitor.count; ++i)
+		if (proc_monitor.procs[i].pid == pid)
+			return &proc_monitor.procs[i];
+	if (proc_monitor.count >= PROC_MAX_TRACKED)
+		return NULL;
+	ProcSample* ps = &proc_monitor.procs[proc_monitor.count++];
+	memset(ps, 0, sizeof(*ps));
+	ps->pid = pid;
+	return ps;
+}
+
+static void proc_sample()
+{
+	DIR* dir = opendir("/proc");
+	if (!dir)
+		return;
+
+	// the thread takes real time, the pump clock may be virtual
+	long long now = system_time_us();
+	static long clk_tck = sysconf(_SC_CLK_TCK);
+	static long page_kb = getpagesize() / 1024;
+	// ticks which mean `proc_runaway_percent` of one CPU since the previous sample
+	unsigned long long hot_ticks = proc_monitor.last_us
+		? (unsigned long long)((now - proc_monitor.last_us) * clk_tck / 1000000 * proc_runaway_percent / 100) : 0;
+	proc_monitor.last_us = now;
+
+	for (int i = 0; i < proc_monitor.count; ++i)
+		proc_monitor.procs[i].alive = false;
+
+	unsigned count = 0;
+	unsigned long rss_kb = 0;
+	unsigned long long cpu_delta = 0;
+	ProcRunaway reports[PROC_MAX_REPORTS];
+	int report_count = 0;
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] < '1' || ent->d_name[0] > '9')
+			continue;
+		pid_t sid = 0;
+		unsigned long long ticks = 0;
+		long rss_pages = 0;
+		char comm[64];
+		if (!proc_read_stat(ent->d_name, sid, ticks, rss_pages, comm, sizeof(comm)) || sid != session_id)
+			continue;
+
+		count++;
+		rss_kb += rss_pages * page_kb;
+
+		ProcSample* ps = proc_find((pid_t)atoi(ent->d_name));
+		if (!ps)
+			continue;
+		// a process not seen before brings all its time, the rest since the previous sample
+		unsigned long long delta = (ps->seen && ticks >= ps->cpu_ticks) ? (ticks - ps->cpu_ticks) : ticks;
+		cpu_delta += delta;
+		if (ps->seen && hot_ticks && delta >= hot_ticks)
+			ps->hot++;
+		else
+			ps->hot = 0;
+		ps->cpu_ticks = ticks;
+		ps->seen = ps->alive = true;
+		if (ps->hot >= proc_runaway_samples && !ps->flagged)
+		{
+			ps->flagged = true;
+			if (report_count < PROC_MAX_REPORTS)
+			{
+				ProcRunaway& r = reports[report_count++];
+				r.pid = ps->pid;
+				strcpy(r.comm, comm);
+				r.cpu_ticks = ticks;
+			}
+		}
+	}
+	closedir(dir);
+
+	// forget exited processes, their time is already in proc_monitor.cpu_ticks
+	for (int i = proc_monitor.count - 1; i >= 0; --i)
+	{
+		if (!proc_monitor.procs[i].alive)
+			proc_monitor.procs[i] = proc_monitor.procs[--proc_monitor.count];
+	}
+
+	pthread_mutex_lock(&proc_monitor.mutex);
+	proc_monitor.samples++;
+	proc_monitor.cur_count = count;
+	proc_monitor.max_count = _max(proc_monitor.max_count, count);
+	proc_monitor.cur_rss_kb = rss_kb;
+	proc_monitor.max_rss_kb = _max(proc_monitor.max_rss_kb, rss_kb);
+	proc_monitor.cpu_ticks += cpu_delta;
+	proc_monitor.runaway += report_count;
+	for (int i = 0; i < report_count && proc_monitor.report_count < PROC_MAX_REPORTS; ++i)
+		proc_monitor.reports[proc_monitor.report_count++] = reports[i];
+	proc_monitor.sample_us = now;
+	proc_monitor.sample_dur_us = (int)(system_time_us() - now);
+	pthread_mutex_unlock(&proc_monitor.mutex);
+}
+
+static void* proc_monitor_thread(void*)
+{
+	pthread_mutex_lock(&proc_monitor.mutex);
+	while (!proc_monitor.stop)
+	{
+		pthread_mutex_unlock(&proc_monitor.mutex);
+		proc_sample();
+		pthread_mutex_lock(&proc_monitor.mutex);
+
+		struct timespec deadline = {};
+		#if defined(HAS_FORKPTY)
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		#else
+		deadline.tv_sec = time(0);  // msys1 does not have clock_gettime
+		#endif
+		long long nsec = deadline.tv_nsec + (proc_monitor.interval_us % 1000000) * 1000;
+		deadline.tv_sec += proc_monitor.interval_us / 1000000 + nsec / 1000000000;
+		deadline.tv_nsec = nsec % 1000000000;
+		while (!proc_monitor.stop)
+		{
+			if (pthread_cond_timedwait(&proc_monitor.cond, &proc_monitor.mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&proc_monitor.mutex);
+	return NULL;
+}
+
+// Called by the pump: starts the sampling thread, prints its reports
+static void proc_monitor_check()
+{
+	if (!proc_monitor.interval_us || session_id <= 0)
+		return;
+	if (!proc_monitor.thread_pid)
+	{
+		proc_monitor.stop = false;
+		if (pthread_create(&proc_monitor.thread, NULL, proc_monitor_thread, NULL) == 0)
+		{
+			proc_monitor.thread_pid = getpid();
+		}
+		else
+		{
+			write_verbose("\r\n\033[31;40m{PID:%u} failed to start process monitor thread\033[m\r\n", getpid());
+			proc_monitor.interval_us = 0;
+		}
+		return;
+	}
+	if (proc_monitor.thread_pid != getpid())
+		return;
+
+	ProcRunaway reports[PROC_MAX_REPORTS];
+	int report_count = 0;
+	pthread_mutex_lock(&proc_monitor.mutex);
+	if (proc_monitor.traced != proc_monitor.samples)
+	{
+		proc_monitor.traced = proc_monitor.samples;
+		trace_span("proc_sample", proc_monitor.sample_us, proc_monitor.sample_dur_us, proc_monitor.cur_count);
+	}
+	if (proc_monitor.report_count)
+	{
+		report_count = proc_monitor.report_count;
+		memcpy(reports, proc_monitor.reports, report_count * sizeof(reports[0]));
+		proc_monitor.report_count = 0;
+	}
+	pthread_mutex_unlock(&proc_monitor.mutex);
+
+	static long clk_tck = sysconf(_SC_CLK_TCK);
+	for (int i = 0; i < report_count && (verbose || show_stats); ++i)
+		write_verbose("\r\n\033[31;40m{PID:%u} runaway child: pid=%i (%s) keeps CPU busy, cpu=%llums\033[m\r\n",
+			getpid(), reports[i].pid, reports[i].comm, reports[i].cpu_ticks * 1000 / clk_tck);
+}
+
+static void proc_monitor_stop()
+{
+	if (!proc_monitor.thread_pid || proc_monitor.thread_pid != getpid())
+		return;
+	pthread_mutex_lock(&proc_monitor.mutex);
+	proc_monitor.stop = true;
+	pthread_cond_broadcast(&proc_monitor.cond);
+	pthread_mutex_unlock(&proc_monitor.mutex);
+	pthread_join(proc_monitor.thread, NULL);
+	proc_monitor.thread_pid = 0;
+}
+
+static void print_stats()
+{
+	if (!verbose && !show_stats && gnLogFileOut < 0)
+		return;
+
+	write_stats("stats: pump.selects=%llu pump.reads=%llu pump.read_bytes=%llu pump.write_texts=%llu",
+		pump_stats.selects, pump_stats.reads, pump_stats.read_bytes, pump_stats.write_texts);
+	if (child_status != -1)
+		write_stats("stats: child.pid=%i child.status=0x%X child.exitcode=%i child.signal=%i", session_id, child_status,
+			WIFEXITED(child_status) ? WEXITSTATUS(child_status) : -1, WIFSIGNALED(child_status) ? WTERMSIG(child_status) : 0);
+	write_stats("stats: sync.frames=%u sync.timeouts=%u sync.overflows=%u",
+		sync_output.frames, sync_output.timeouts, sync_output.overflows);
+	if (sgr_min.enabled)
+		write_stats("stats: sgr.seqs=%llu sgr.merged=%llu sgr.bytes_in=%llu sgr.bytes_out=%llu sgr.saved=%llu",
+			sgr_min.seqs, sgr_min.dropped, sgr_min.bytes_in, sgr_min.bytes_out,
+			(sgr_min.bytes_in > sgr_min.bytes_out) ? (sgr_min.bytes_in - sgr_min.bytes_out) : 0ULL);
+	if (predict.enabled)
+		write_stats("stats: predict.keys=%u predict.shown=%u predict.confirmed=%u predict.mispredicted=%u predict.expired=%u predict.saved_ms=%lld predict.avg_saved_us=%lld",
+			predict.predicted, predict.displayed, predict.confirmed, predict.mispredicted, predict.expired,
+			predict.saved_us / 1000, predict.saved_keys ? (predict.saved_us / predict.saved_keys) : 0LL);
+	if (cmd_timing.count)
+		write_stats("stats: cmd.count=%u cmd.failed=%u cmd.total_ms=%lld cmd.avg_ms=%lld cmd.max_ms=%lld cmd.max=%s",
+			cmd_timing.count, cmd_timing.failed, cmd_timing.total_us / 1000, cmd_timing.total_us / 1000 / cmd_timing.count,
+			cmd_timing.max_us / 1000, cmd_timing.max_text);
+	if (queries.answered || queries.forwarded)
+		write_stats("stats: query.answered=%u query.forwarded=%u query.learned=%u",
+			queries.answered, queries.forwarded, queries.learned);
+	if (payload.count)
+		write_stats("stats: payload.count=%u payload.bytes=%llu payload.max=%lld payload.limit=%lld payload.dropped=%u payload.dropped_bytes=%llu",
+			payload.count, payload.bytes, payload.max, payload.limit, payload.dropped, payload.dropped_bytes);
+	if (background.hides)
+		write_stats("stats: background.hides=%u background.hidden_ms=%lld background.bytes=%llu background.payload_bytes=%llu background.repaints=%u background.nudges=%u",
+			background.hides, (background.hidden_us + (background.hidden ? (get_time_us() - background.since_us) : 0)) / 1000,
+			background.bytes, background.payload_bytes, background.repaints, background.nudges);
+	if (trigger.enabled)
+		write_stats("stats: trigger.count=%i trigger.bytes=%llu trigger.hits=%u trigger.verified=%u trigger.notified=%u trigger.hooks=%u trigger.suppressed=%u",
+			trigger.count, trigger.bytes, trigger.hits, trigger.verified, trigger.notified, trigger.hooks, trigger.suppressed);
+	if (progress.enabled)
+		write_stats("stats: progress.squashed=%llu progress.bytes_elided=%llu", progress.squashed, progress.bytes_elided);
+	if (proc_monitor.interval_us)
+	{
+		struct rusage ru = {};
+		getrusage(RUSAGE_SELF, &ru);
+		long long self_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000LL + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+		long clk_tck = sysconf(_SC_CLK_TCK);
+		write_stats("stats: proc.samples=%u proc.count=%u proc.max_count=%u proc.cpu_ms=%llu proc.rss_kb=%lu proc.max_rss_kb=%lu proc.runaway=%u self.cpu_ms=%lld",
+			proc_monitor.samples, proc_monitor.cur_count, proc_monitor.max_count,
+			proc_monitor.cpu_ticks * 1000 / clk_tck, proc_monitor.cur_rss_kb, proc_monitor.max_rss_kb,
+			proc_monitor.runaway, self_ms);
+	}
+	write_stats("stats: cwd.reports=%u cwd.changes=%u cwd.conversions=%u cwd.cache_hits=%u",
+		cwd_tracker.reports, cwd_tracker.changes, cwd_tracker.conversions, cwd_tracker.cache_hits);
+	write_stats("stats: echo.samples=%u echo.expired=%u echo.avg_us=%lld echo.max_us=%lld echo.hist=%u/%u/%u/%u/%u",
+		echo_stats.samples, echo_stats.expired,
+		echo_stats.samples ? (echo_stats.total_us / echo_stats.samples) : 0LL, echo_stats.max_us,
+		echo_stats.hist[0], echo_stats.hist[1], echo_stats.hist[2], echo_stats.hist[3], echo_stats.hist[4]);
+}
+
+static int run()
+{
+	fd_set fds;
+	const int preferredCount = 280;
+	const int bufCount = 4096;
+	char buf[bufCount+1];
+
+	watch_child();
+
+	for (;;)
+	{
+		long long iter_us = trace_begin();
+
+		FD_ZERO(&fds);
+		if (sigchld_pipe[0] >= 0)
+			FD_SET(sigchld_pipe[0], &fds);
+		if (pty_fd >= 0)
+		{
+			FD_SET(pty_fd, &fds);
+			if (pty_err >= 0)
+				FD_SET(pty_err, &fds);
+		}
+		else if (session_link.fd >= 0)
+		{
+			FD_SET(session_link.fd, &fds);
+		}
+		else if (session_closed())
+		{
+			// Pty gone and the shell was already reaped (e.g. on SIGCHLD)
+			break;
+		}
+		else
+		{
+			// Pty gone, but process still there: keep checking?
+		}
+
+		const int fdsmax = _max(_max(_max(pty_fd,pty_err),sigchld_pipe[0]),session_link.fd) + 1;
+		debug_log_format("%u:PID=%u:TID=%u: calling select on (%i,%i)\n", GetTickCount(), getpid(), GetCurrentThreadId(), pty_fd, pty_err);
+		pump_stats.selects++;
+		long long select_us = trace_begin();
+		int ready = pump_clock.wait(fdsmax, &fds, 10000);
+		trace_end("select", select_us, ready);
+		if (ready > 0)
+		{
+			if (pty_fd >= 0 && FD_ISSET(pty_fd, &fds))
+			{
+				int len = process_pty(pty_fd, buf, bufCount, preferredCount);
+				// Flush the queued bulk output early, the echo of typed keys is behind it
+				for (int flushed = len; (len == bufCount) && (flushed < echo_drain_max) && (pty_fd >= 0) && echo_pending(); flushed += len)
+				{
+					len = process_pty(pty_fd, buf, bufCount, preferredCount);
+				}
+				if (verbose && (pty_fd < 0))
+					write_verbose("\r\n\033[31;40m{PID:%u} pty_fd set to -1\033[m\r\n", getpid(), pid);
+			}
+
+			if (pty_err >= 0 && FD_ISSET(pty_err, &fds))
+			{
+				process_pty(pty_err, buf, bufCount, preferredCount);
+				if (verbose && (pty_err < 0))
+					write_verbose("\r\n\033[31;40m{PID:%u} pty_err set to -1\033[m\r\n", getpid(), pid);
+			}
+
+			if (session_link.fd >= 0 && FD_ISSET(session_link.fd, &fds))
+			{
+				process_session();
+			}
+
+			if (sigchld_pipe[0] >= 0 && FD_ISSET(sigchld_pipe[0], &fds))
+			{
+				char sig_buf[16];
+				while (read(sigchld_pipe[0], sig_buf, sizeof(sig_buf)) > 0)
+					;
+				// reap the shell immediately
+				check_child();
+				trigger_reap();
+			}
+		}
+		else
+		{
+			debug_log_format("%u:PID=%u:TID=%u: select failed\n", GetTickCount(), getpid(), GetCurrentThreadId());
+			output_idle();
+		}
+		sync_check_timeout();
+		proc_monitor_check();
+		background_check();
+
+		// Don't let the input starve the output, 10ms at most
+		long long input_us = get_time_us();
+		while (read_input())
+		{
+			if ((get_time_us() - input_us) >= 10000)
+				break;
+		}
+
+		if (session_finished())
+		{
+			// Pass the last output of the shell to the terminal, but don't let
+			// the orphaned descendants keep us running
+			for (int drained = 0; pty_fd >= 0 && drained < echo_drain_max;)
+			{
+				int len = process_pty(pty_fd, buf, bufCount, preferredCount);
+				if (len <= 0)
+					break;
+				drained += len;
+			}
+			if (verbose)
+				write_verbose("\r\n\033[31;40m{PID:%u} session %i is finished, closing\033[m\r\n", getpid(), session_id);
+			kill(-session_id, SIGHUP);
+			break;
+		}
+
+		if (exit_signal)
+			break;
+
+		trace_end("run", iter_us);
+	}
+
+	check_child(true);
+
+	signal(SIGCHLD, SIG_DFL);
+
+	proc_monitor_stop();
+	print_stats();
+
+	stop_threads();
+	exit_on_signal();
+
+	return child_exit_code();
+}
+
+// Detached sessions: with `--detach` the pty and the shell live in the background
+// holder process, it survives closing of the tab. Connectors started with `--attach`
+// become its clients, the holder repaints the screen for them on connect.
+// Sockets are "$TMPDIR/conemu-connector-UID/NAME", NAME is holder PID by default.
+// The same protocol is used by `--connect` for external backends (unix socket path
+// or "host:port"), and `--serve` runs the holder in foreground as stand-in backend.
+static bool holder = false;
+static pid_t holder_pid = 0;
+// `--session-key <file>`: shared secret sent in sf_Hello, the holder refuses clients
+// without it; required by `--serve host:port`. `--serve-remote` allows binding
+// other than loopback addresses, the protocol is not encrypted
+static char* session_key = NULL;
+static int session_key_len = 0;
+static bool serve_remote = false;
+static int holder_listen = -1;
+static char* session_path = NULL;
+static VtScanner holder_scanner = {};
+
+static char* session_socket_path(const char* name)
+{
+	const char* tmp = getenv("TMPDIR");
+	if (!tmp || !*tmp)
+		tmp = "/tmp";
+	char* path = (char*)malloc(strlen(tmp) + strlen(name) + 64);
+	if (!path)
+		return NULL;
+	sprintf(path, "%s/conemu-connector-%u", tmp, (unsigned)getuid());
+	// Only the directory keeps others off our sockets, don't trust one made by somebody else
+	struct stat st = {};
+	if ((mkdir(path, 0700) != 0 && errno != EEXIST) || lstat(path, &st) != 0
+		|| !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0777) != 0700)
+	{
+		write_verbose("\033[30;41m\033[K{PID:%u} unsafe session directory `%s`, it must be a directory of uid=%u with mode 0700\033[m\r\n", getpid(), path, (unsigned)getuid());
+		free(path);
+		errno = EACCES;
+		return NULL;
+	}
+	if (*name)
+		sprintf(path + strlen(path), "/%s", name);
+	return path;
+}
+
+static bool session_address(const char* path, struct sockaddr_un& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (!path || strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	return true;
+}
+
+static int session_connect(const char* path)
+{
+	struct sockaddr_un addr;
+	if (!session_address(path, addr))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+static int session_listen(const char* path)
+{
+	struct sockaddr_un addr;
+	if (!session_address(path, addr))
+		return -1;
+	// Socket of dead holder may be left, but don't steal the alive one
+	int alive = session_connect(path);
+	if (alive >= 0)
+	{
+		close(alive);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+	{
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+// The key is the first line of the file which only its owner may read
+static bool load_session_key(const char* file)
+{
+	int fd = open(file, O_RDONLY);
+	struct stat st = {};
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("{PID:%u} can't open session key `%s` (%i): %s\r\n", getpid(), file, errno, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	if (st.st_mode & 077)
+	{
+		printf("{PID:%u} session key `%s` is accessible by others, chmod 600 it\r\n", getpid(), file);
+		close(fd);
+		return false;
+	}
+	char key[257];
+	int len = read(fd, key, sizeof(key) - 1);
+	close(fd);
+	if (len < 0)
+		len = 0;
+	key[len] = 0;
+	len = strcspn(key, "\r\n");
+	if (len < 8)
+	{
+		printf("{PID:%u} session key `%s` is shorter than 8 characters\r\n", getpid(), file);
+		return false;
+	}
+	free(session_key);
+	session_key = (char*)malloc(len);
+	memcpy(session_key, key, len);
+	session_key_len = len;
+	memset(key, 0, sizeof(key));
+	return true;
+}
+
+static bool session_key_valid(const char* data, int len)
+{
+	if (!session_key)
+		return true;
+	// the time does not depend on the matched prefix
+	unsigned diff = (len != session_key_len);
+	for (int i = 0; i < session_key_len; ++i)
+		diff |= (unsigned char)session_key[i] ^ (unsigned char)((i < len) ? data[i] : 0);
+	return !diff;
+}
+
+static bool session_loopback(const struct sockaddr* sa)
+{
+	if (sa->sa_family == AF_INET)
+		return (ntohl(((const struct sockaddr_in*)sa)->sin_addr.s_addr) >> 24) == 127;
+	#if defined(AF_INET6) && defined(IN6_IS_ADDR_LOOPBACK)
+	if (sa->sa_family == AF_INET6)
+	{
+		const struct in6_addr* a = &((const struct sockaddr_in6*)sa)->sin6_addr;
+		return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+	}
+	#endif
+	return false;
+}
+
+// "host:port", empty host is loopback
+static bool session_is_tcp(const char* spec)
+{
+	return spec && !strchr(spec, '/') && strrchr(spec, ':');
+}
+
+static int session_tcp(const char* spec, bool server)
+{
+	const char* colon = strrchr(spec, ':');
+	char host[256];
+	int host_len = _min((int)(colon - spec), (int)sizeof(host) - 1);
+	memcpy(host, spec, host_len);
+	host[host_len] = 0;
+
+	struct addrinfo hints = {}, *list = NULL;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int gai_rc = getaddrinfo(*host ? host : "127.0.0.1", colon + 1, &hints, &list);
+	if (gai_rc != 0)
+	{
+		write_verbose("\033[30;41m\033[K{PID:%u} getaddrinfo(`%s`) failed: %s\033[m\r\n", getpid(), spec, gai_strerror(gai_rc));
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo* ai = list; ai && fd < 0; ai = ai->ai_next)
+	{
+		if (server && !serve_remote && !session_loopback(ai->ai_addr))
+		{
+			write_verbose("\033[30;41m\033[K{PID:%u} `%s` is not a loopback address, use --serve-remote to allow it\033[m\r\n", getpid(), spec);
+			errno = EACCES;
+			continue;
+		}
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		int on = 1;
+		bool ok;
+		if (server)
+		{
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+			ok = (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(fd, 4) == 0);
+		}
+		else
+		{
+			ok = (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0);
+			// keystrokes must not wait for Nagle
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+		}
+		if (!ok)
+		{
+			int e = errno;
+			close(fd);
+			fd = -1;
+			errno = e;
+		}
+	}
+	freeaddrinfo(list);
+	if (fd >= 0)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+static void remove_session_socket()
+{
+	if (holder && holder_pid == getpid() && session_path)
+		unlink(session_path);
+}
+
+// Alive sessions are printed with `--sessions`, `--attach` without name
+// picks the most recent one. Returns the count of alive sessions.
+static int find_sessions(bool print, char** latest)
+{
+	char* dir_path = session_socket_path("");
+	DIR* dir = dir_path ? opendir(dir_path) : NULL;
+	int count = 0;
+	time_t latest_time = 0;
+	if (latest)
+		*latest = NULL;
+	if (dir)
+	{
+		struct dirent* ent;
+		while ((ent = readdir(dir)) != NULL)
+		{
+			if (ent->d_name[0] == '.')
+				continue;
+			char* path = session_socket_path(ent->d_name);
+			struct stat st = {};
+			int fd = path ? session_connect(path) : -1;
+			if (fd < 0 || stat(path, &st) != 0)
+			{
+				if (fd >= 0)
+					close(fd);
+				free(path);
+				continue;
+			}
+			close(fd);
+			++count;
+			if (print)
+				printf("%s\t%s", ent->d_name, ctime(&st.st_mtime));
+			if (latest && (!*latest || st.st_mtime >= latest_time))
+			{
+				free(*latest);
+				*latest = path;
+				latest_time = st.st_mtime;
+			}
+			else
+			{
+				free(path);
+			}
+		}
+		closedir(dir);
+	}
+	if (print && !count)
+		printf("No detached sessions in `%s`\n", dir_path ? dir_path : "");
+	free(dir_path);
+	return count;
+}
+
+// switch `--attach [name]`, this process becomes the client of the holder
+static int attach_session(const char* name)
+{
+	char* path = NULL;
+	if (session_is_tcp(name) || (name && strchr(name, '/')))
+		path = strdup(name);
+	else if (name)
+		path = session_socket_path(name);
+	else
+		find_sessions(false, &path);
+	if (session_is_tcp(path))
+		session_link.fd = session_tcp(path, false);
+	else
+		session_link.fd = path ? session_connect(path) : -1;
+	if (session_link.fd < 0)
+	{
+		write_verbose("\033[30;41m\033[K{PID:%u} can't attach to session `%s` (%i): %s\033[m\r\n", getpid(), path ? path : (name ? name : ""), errno, strerror(errno));
+		free(path);
+		return -1;
+	}
+	if (verbose)
+		write_verbose("\033[31;40m{PID:%u} attached to session `%s`\033[m\r\n", getpid(), path);
+	free(path);
+
+	session_link.pos = session_link.used = 0;
+	char hello[4 + 256];
+	lz4_write32((unsigned char*)hello, SESS_PROTOCOL);
+	if (session_key)
+		memcpy(hello + 4, session_key, session_key_len);
+	sess_send(session_link.fd, sf_Hello, hello, 4 + session_key_len);
+	return 0;
+}
+
+// switch `--serve <name|path|host:port>`, this process is the holder,
+// it does not connect to the host and it's not detached from the console
+static int serve_session(const char* spec)
+{
+	holder = true;
+	holder_pid = getpid();
+	if (session_is_tcp(spec))
+	{
+		if (!session_key)
+		{
+			write_verbose("\033[30;41m\033[K{PID:%u} --serve `%s` requires --session-key\033[m\r\n", getpid(), spec);
+			return -1;
+		}
+		holder_listen = session_tcp(spec, true);
+	}
+	else
+	{
+		session_path = strchr(spec, '/') ? strdup(spec) : session_socket_path(spec);
+		holder_listen = session_path ? session_listen(session_path) : -1;
+		atexit(remove_session_socket);
+	}
+	if (holder_listen < 0)
+	{
+		write_verbose("\033[30;41m\033[K{PID:%u} can't listen `%s` (%i): %s\033[m\r\n", getpid(), spec, errno, strerror(errno));
+		return -1;
+	}
+	if (verbose)
+		write_verbose("\033[31;40m{PID:%u} serving session on `%s`\033[m\r\n", getpid(), spec);
+	return 0;
+}
+
+// switch `--detach [name]`, the holder is forked before the host is connected;
+// returns 0 in both processes, `holder` is set in the background one
+static int start_holder(const char* name)
+{
+	int ready[2];
+	char holder_name[32];
+	if (pipe(ready) != 0)
+		return -1;
+
+	pid_t child = fork();
+	if (child == -1)
+	{
+		child_err_msg("fork failed");
+		return -1;
+	}
+
+	if (child == 0)
+	{
+		close(ready[0]);
+		holder = true;
+		holder_pid = getpid();
+		// Leave the console of the tab, its closing must not kill us
+		setsid();
+		FreeConsole();
+
+		if (!name)
+		{
+			sprintf(holder_name, "%u", getpid());
+			name = holder_name;
+		}
+		session_path = session_socket_path(name);
+		holder_listen = session_path ? session_listen(session_path) : -1;
+		char ok = (holder_listen >= 0) ? 1 : 0;
+		int e = errno;
+		write(ready[1], &ok, 1);
+		write(ready[1], &e, sizeof(e));
+		close(ready[1]);
+		if (!ok)
+			exit(253);
+		atexit(remove_session_socket);
+
+		int null_fd = open("/dev/null", O_RDWR);
+		if (null_fd >= 0)
+		{
+			for (int f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+				dup2(null_fd, f);
+			if (null_fd > STDERR_FILENO)
+				close(null_fd);
+		}
+		return 0;
+	}
+
+	close(ready[1]);
+	char ok = 0;
+	int e = 0;
+	read(ready[0], &ok, 1);
+	read(ready[0], &e, sizeof(e));
+	close(ready[0]);
+	if (!ok)
+	{
+		write_verbose("\033[30;41m\033[K{PID:%u} session holder failed to listen `%s` (%i): %s\033[m\r\n", getpid(), name ? name : "", e, strerror(e));
+		return -1;
+	}
+	if (!name)
+	{
+		sprintf(holder_name, "%u", child);
+		name = holder_name;
+	}
+	return attach_session(name);
+}
+
+static void holder_output(const char* buf, int len)
+{
+	const char* p = buf;
+	const char* end = buf + len;
+	VtToken tok;
+	while (vt_next(holder_scanner, p, end, tok))
+	{
+		modes_process(tok);
+		if (replay_restarts(tok))
+			replay_reset();
+		replay_append(tok.ptr, tok.len);
+	}
+}
+
+// Frames for the client of the holder are queued, its socket is non-blocking.
+// The pty is not read while the queue is full, so the shell waits for a slow
+// client like for a slow terminal; a client which takes nothing for a while is dropped.
+#define SESS_QUEUE_HIGH (256*1024)
+const long long sess_stall_us = 5000000;
+const long long sess_hello_us = 5000000;  // new connection must introduce itself in time
+struct SessionQueue
+{
+	char* data;
+	int used, size;
+	long long progress_us;  // when the client took the data last time
+};
+static SessionLink client = {-1};
+static SessionQueue client_queue = {};
+
+static bool queue_frame(SessionQueue& q, char type, const void* data, int len)
+{
+	if (!q.used)
+		q.progress_us = get_time_us();
+	const char* p = (const char*)data;
+	do {
+		int part = (len > SESS_FRAME_MAX) ? SESS_FRAME_MAX : len;
+		if (q.used + SESS_HEADER + part > q.size)
+		{
+			int size = _max(q.size * 2, q.used + SESS_HEADER + part + SESS_FRAME_MAX);
+			char* grown = (char*)realloc(q.data, size);
+			if (!grown)
+				return false;
+			q.data = grown;
+			q.size = size;
+		}
+		q.data[q.used] = type;
+		lz4_write32((unsigned char*)q.data + q.used + 1, part);
+		memcpy(q.data + q.used + SESS_HEADER, p, part);
+		q.used += SESS_HEADER + part;
+		p += part; len -= part;
+	} while (len > 0);
+	return true;
+}
+
+// Write as much as the socket takes, false if the client is gone
+static bool queue_flush(SessionQueue& q, int fd)
+{
+	int done = 0;
+	while (done < q.used)
+	{
+		ssize_t written = write(fd, q.data + done, q.used - done);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (written <= 0)
+			return false;
+		done += written;
+	}
+	if (done > 0)
+	{
+		memmove(q.data, q.data + done, q.used - done);
+		q.used -= done;
+		q.progress_us = get_time_us();
+	}
+	return true;
+}
+
+static void holder_drop_client(const char* reason)
+{
+	if (client.fd < 0)
+		return;
+	if (verbose)
+		write_verbose("\r\n\033[31;40m{PID:%u} client %i dropped: %s\033[m\r\n", getpid(), client.fd, reason);
+	safe_close(client.fd);
+	client_queue.used = 0;
+}
+
+static void holder_send(char type, const void* data, int len)
+{
+	if (client.fd < 0)
+		return;
+	if (!queue_frame(client_queue, type, data, len))
+		holder_drop_client("out of memory");
+	else if (!queue_flush(client_queue, client.fd))
+		holder_drop_client("write failed");
+}
+
+// Repaint the screen of the new client: tracked modes, clear, recent output
+static void holder_replay()
+{
+	char prefix[400];
+	int len = format_term_modes(prefix, term_modes);
+	len += sprintf(prefix + len, "\033[H\033[2J");
+	len += replay_format_pen(prefix + len);
+	holder_send(sf_Data, prefix, len);
+	if (replay_used)
+		holder_send(sf_Data, replay_buf, replay_used);
+}
+
+// The first frame of a new connection, returns the reason to refuse it;
+// until it's accepted the connection gets nothing and can't take the session over
+static const char* holder_check_hello(char type, const char* data, int len)
+{
+	static char reason[80];
+	if (type != sf_Hello || len < 4)
+		return "hello expected";
+	unsigned version = lz4_read32((const unsigned char*)data);
+	if (version != SESS_PROTOCOL)
+	{
+		sprintf(reason, "protocol %u is not supported, the holder speaks %u", version, SESS_PROTOCOL);
+		return reason;
+	}
+	if (!session_key_valid(data + 4, len - 4))
+		return "wrong session key";
+	return NULL;
+}
+
+// Frames received from the client, `attached` is set by the first size
+static void holder_client_frames(bool& attached)
+{
+	int rc;
+	char type; const char* data; int data_len;
+	while (client.fd >= 0 && (rc = sess_next(client, type, data, data_len)) > 0)
+	{
+		switch (type)
+		{
+		case sf_Data:
+			if (pty_fd >= 0)
+				write_all(pty_fd, data, data_len);
+			break;
+		case sf_Size:
+		{
+			struct winsize winp;
+			sess_get_size(data, data_len, &winp);
+			if (pty_fd >= 0 && winp.ws_col && winp.ws_row)
+			{
+				if (attached)
+					resize_pty(pty_fd, &winp);
+				else
+					nudge_pty_size(pty_fd, &winp);
+			}
+			attached = true;
+			break;
+		}
+		}
+	}
+	if (client.fd >= 0 && rc < 0)
+		holder_drop_client("protocol error");
+}
+
+static int hold_session()
+{
+	fd_set fds, wfds;
+	static SessionLink pending = {-1};  // accepted, but hello was not received yet
+	static char buf[SESS_FRAME_MAX];
+	long long pending_us = 0;
+	bool attached = false;  // the first size from the client forces repaint
+
+	watch_child();
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;)
+	{
+		struct timeval timeout = {0, 100000};
+
+		if (pty_fd < 0 && session_closed())
+			break;
+
+		FD_ZERO(&fds);
+		FD_ZERO(&wfds);
+		if (sigchld_pipe[0] >= 0)
+			FD_SET(sigchld_pipe[0], &fds);
+		if (pty_fd >= 0 && !(client.fd >= 0 && client_queue.used >= SESS_QUEUE_HIGH))
+			FD_SET(pty_fd, &fds);
+		if (holder_listen >= 0)
+			FD_SET(holder_listen, &fds);
+		if (pending.fd >= 0)
+			FD_SET(pending.fd, &fds);
+		if (client.fd >= 0)
+		{
+			FD_SET(client.fd, &fds);
+			if (client_queue.used)
+				FD_SET(client.fd, &wfds);
+		}
+
+		const int fdsmax = _max(_max(_max(_max(pty_fd,holder_listen),sigchld_pipe[0]),client.fd),pending.fd) + 1;
+		if (select(fdsmax, &fds, &wfds, 0, &timeout) > 0)
+		{
+			if (client.fd >= 0 && FD_ISSET(client.fd, &wfds) && !queue_flush(client_queue, client.fd))
+				holder_drop_client("write failed");
+
+			if (pty_fd >= 0 && FD_ISSET(pty_fd, &fds))
+			{
+				int len = read(pty_fd, buf, sizeof(buf));
+				if (len > 0)
+				{
+					pump_stats.read_bytes += len;
+					holder_output(buf, len);
+					holder_send(sf_Data, buf, len);
+				}
+				else if (!(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+				{
+					close(pty_fd);
+					pty_fd = -1;
+				}
+			}
+
+			if (holder_listen >= 0 && FD_ISSET(holder_listen, &fds))
+			{
+				int fd = accept(holder_listen, NULL, NULL);
+				if (fd >= 0)
+				{
+					// The client takes the session over after its hello is checked
+					int on = 1;
+					fcntl(fd, F_SETFD, FD_CLOEXEC);
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+					safe_close(pending.fd);
+					pending.fd = fd;
+					pending.pos = pending.used = 0;
+					pending_us = get_time_us();
+				}
+			}
+
+			if (pending.fd >= 0 && FD_ISSET(pending.fd, &fds))
+			{
+				int len = sess_fill(pending);
+				int rc = 0;
+				char type; const char* data; int data_len;
+				if (len > 0)
+					rc = sess_next(pending, type, data, data_len);
+				else if (!(len < 0 && errno == EINTR))
+					rc = -1;
+				const char* reason = (rc > 0) ? holder_check_hello(type, data, data_len) : NULL;
+				if (reason)
+				{
+					if (verbose)
+						write_verbose("\r\n\033[31;40m{PID:%u} client refused: %s\033[m\r\n", getpid(), reason);
+					sess_send(pending.fd, sf_Error, reason, strlen(reason));
+					rc = -1;
+				}
+				if (rc < 0)
+				{
+					safe_close(pending.fd);
+				}
+				else if (rc > 0)
+				{
+					holder_drop_client("taken over by new client");
+					client = pending;
+					pending.fd = -1;
+					fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) | O_NONBLOCK);
+					attached = false;
+					holder_replay();
+					// the size may have come together with the hello
+					holder_client_frames(attached);
+				}
+			}
+
+			if (client.fd >= 0 && FD_ISSET(client.fd, &fds))
+			{
+				int len = sess_fill(client);
+				if (len > 0)
+					holder_client_frames(attached);
+				// Client is closed (tab was closed), the session stays
+				else if (!(len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)))
+					holder_drop_client("closed");
+			}
+
+			if (sigchld_pipe[0] >= 0 && FD_ISSET(sigchld_pipe[0], &fds))
+			{
+				char sig_buf[16];
+				while (read(sigchld_pipe[0], sig_buf, sizeof(sig_buf)) > 0)
+					;
+				check_child();
+			}
+		}
+
+		long long now = get_time_us();
+		if (pending.fd >= 0 && (now - pending_us) >= sess_hello_us)
+			safe_close(pending.fd);
+		if (client.fd >= 0 && client_queue.used && (now - client_queue.progress_us) >= sess_stall_us)
+			holder_drop_client("stalled");
+
+		if (session_finished())
+		{
+			kill(-session_id, SIGHUP);
+			break;
+		}
+		if (exit_signal)
+			break;
+	}
+
+	check_child();
+	signal(SIGCHLD, SIG_DFL);
+
+	if (client.fd >= 0)
+	{
+		unsigned char status[4];
+		lz4_write32(status, (unsigned)child_status);
+		holder_send(sf_Exit, status, sizeof(status));
+		// The rest of the output and the status, but don't wait for a stalled client
+		long long deadline = get_time_us() + 1000000;
+		while (client.fd >= 0 && client_queue.used && get_time_us() < deadline)
+		{
+			struct timeval timeout = {0, 100000};
+			FD_ZERO(&wfds);
+			FD_SET(client.fd, &wfds);
+			if (select(client.fd + 1, 0, &wfds, 0, &timeout) > 0 && !queue_flush(client_queue, client.fd))
+				break;
+		}
+		safe_close(client.fd);
+	}
+	safe_close(pending.fd);
+	safe_close(holder_listen);
+	remove_session_socket();
+	exit_on_signal();
+
+	return child_exit_code();
+}
+
+// switch `--keys` useful to check keyboard translations
+static int test_read_keys()
+{
+	struct termios old = {0}, raw = {};
+
+	print_version();
+	printf("Starting raw conin reader, press Ctrl+C to stop\n");
+
+	if (tcgetattr(0, &old) < 0)
+		perror("tcgetattr()");
+	raw = old;
+	raw.c_lflag &= ~(ICANON|ECHO);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(0, TCSANOW, &raw) < 0)
+		perror("tcsetattr()");
+
+	for (;;)
+	{
+		int c = fgetc(stdin);
+		if (c > 32 && c != 0x7F)
+			printf("<x%02X:%c>", c, c);
+		else if (c == 0xA)
+			printf("<ENTER>\n");
+		else
+			printf("<x%02X>", c);
+	}
+
+	if (tcsetattr(0, TCSADRAIN, &old) < 0)
+		perror ("reverting tcsetattr()");
+
+	return 0;
+}
+
+// switch `--bench [iterations]` runs microbenchmarks of the hot paths
+// with stub host callbacks, results are printed in CSV format;
+// no ConEmu or console is needed, but it is still a cygwin/msys build
+static const INPUT_RECORD* bench_records = NULL;
+static DWORD bench_records_count = 0;
+static ReadInputResult bench_records_result = rir_None;
+static long long bench_written = 0;
+static unsigned bench_write_calls = 0;
+
+static ReadInputResult WINAPI bench_read_input(PINPUT_RECORD buffer, DWORD buffer_count, PDWORD result_count)
+{
+	DWORD count = (bench_records_count < buffer_count) ? bench_records_count : buffer_count;
+	memcpy(buffer, bench_records, count * sizeof(*buffer));
+	*result_count = count;
+	return count ? bench_records_result : rir_None;
+}
+
+static BOOL WINAPI bench_write_text(LPCSTR pBuffer, DWORD cbWrite, PDWORD pcbWritten, WriteProcessedStream nStream)
+{
+	if (cbWrite == (DWORD)-1)
+		cbWrite = strlen(pBuffer);
+	bench_written += cbWrite;
+	bench_write_calls++;
+	*pcbWritten = cbWrite;
+	return TRUE;
+}
+
+static void bench_report(const char* name, int iterations, long long total_us, long long bytes)
+{
+	printf("%s,%i,%lld,%.1f,%.1f\n", name, iterations, total_us,
+		iterations ? (total_us * 1000.0 / iterations) : 0.0,
+		(total_us && bytes) ? (bytes / (double)total_us) : 0.0);
+	fflush(stdout);
+}
+
+static void bench_key(INPUT_RECORD& r, wchar_t ch, bool down)
+{
+	memset(&r, 0, sizeof(r));
+	r.EventType = KEY_EVENT;
+	r.Event.KeyEvent.bKeyDown = down;
+	r.Event.KeyEvent.wRepeatCount = 1;
+	r.Event.KeyEvent.wVirtualKeyCode = (ch >= 'a' && ch <= 'z') ? (ch - 'a' + 'A') : ch;
+	r.Event.KeyEvent.uChar.UnicodeChar = ch;
+}
+
+static int run_benchmarks(int iterations)
+{
+	const int bufCount = 4096, preferredCount = 280;
+	char buf[bufCount+1];
+	long long t;
+	int i;
+
+	if (iterations <= 0)
+		iterations = 100000;
+
+	memset(&Connector, 0, sizeof(Connector));
+	Connector.cbSize = sizeof(Connector);
+	Connector.ReadInput = bench_read_input;
+	Connector.WriteText = bench_write_text;
+	pid = 0;
+
+	pty_fd = open("/dev/null", O_WRONLY);
+	if (pty_fd < 0)
+	{
+		perror("open(/dev/null)");
+		return 2;
+	}
+
+	printf("name,iterations,total_us,ns_per_op,bytes_per_us\n");
+
+	// write_input_buffered: one key and flush, as read_input does for typing
+	char key[] = "a";
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+	{
+		write_input_buffered(key, 1);
+		write_input_buffered(NULL, 0);
+	}
+	bench_report("write_input_buffered.key_flush", iterations, get_time_us() - t, iterations);
+
+	// write_input_buffered: paste, flushed when the buffer is full
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		write_input_buffered(key, 1);
+	write_input_buffered(NULL, 0);
+	bench_report("write_input_buffered.paste", iterations, get_time_us() - t, iterations);
+
+	// read_input: typing (key down/up pairs), paste (key down only, more data), resize
+	const int mix_count = 32;
+	INPUT_RECORD typing[mix_count], paste[mix_count], resize[mix_count];
+	for (int n = 0; n < mix_count; ++n)
+	{
+		bench_key(typing[n], 'a' + (n / 2) % 26, !(n & 1));
+		bench_key(paste[n], 'a' + n % 26, true);
+		memset(&resize[n], 0, sizeof(resize[n]));
+		resize[n].EventType = WINDOW_BUFFER_SIZE_EVENT;
+		resize[n].Event.WindowBufferSizeEvent.dwSize.X = 80 + n;
+		resize[n].Event.WindowBufferSizeEvent.dwSize.Y = 25;
+	}
+	struct { const char* name; const INPUT_RECORD* records; ReadInputResult rc; int divider; } mixes[] = {
+		{"read_input.typing", typing, rir_Ready, 1},
+		{"read_input.paste", paste, rir_Ready_More, 1},
+		{"read_input.resize", resize, rir_Ready, 16},
+	};
+	for (size_t m = 0; m < sizeof(mixes)/sizeof(mixes[0]); ++m)
+	{
+		int calls = iterations / mix_count / mixes[m].divider + 1;
+		bench_records = mixes[m].records;
+		bench_records_count = mix_count;
+		bench_records_result = mixes[m].rc;
+		t = get_time_us();
+		for (i = 0; i < calls; ++i)
+			read_input();
+		write_input_buffered(NULL, 0);
+		bench_report(mixes[m].name, calls * mix_count, get_time_us() - t, 0);
+	}
+	bench_records_count = 0;
+
+	// process_pty: small chunks (as echo and prompts arrive) coalesced into one WriteText
+	int pipe_fd[2];
+	if (pipe(pipe_fd) == 0)
+	{
+		fcntl(pipe_fd[0], F_SETFL, O_NONBLOCK);
+		char chunk[40];
+		memset(chunk, 'x', sizeof(chunk));
+		const int chunks = 8;
+		int calls = iterations / 10 + 1;
+		int pipe_rd = pipe_fd[0];
+		long long bytes = 0;
+		bench_write_calls = 0;
+		t = get_time_us();
+		for (i = 0; i < calls && pipe_rd >= 0; ++i)
+		{
+			for (int c = 0; c < chunks; ++c)
+				write(pipe_fd[1], chunk, sizeof(chunk));
+			bytes += process_pty(pipe_rd, buf, bufCount, preferredCount);
+		}
+		bench_report("process_pty.coalesce", calls, get_time_us() - t, bytes);
+		printf("process_pty.coalesce.writetext_per_call,%i,0,%.2f,0\n", calls, calls ? (bench_write_calls / (double)calls) : 0.0);
+
+		// full buffer reads
+		memset(buf, 'y', bufCount);
+		bytes = 0;
+		t = get_time_us();
+		for (i = 0; i < calls && pipe_rd >= 0; ++i)
+		{
+			write(pipe_fd[1], buf, bufCount);
+			bytes += process_pty(pipe_rd, buf, bufCount, preferredCount);
+		}
+		bench_report("process_pty.bulk", calls, get_time_us() - t, bytes);
+
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+	}
+
+	// write_console: plain and with (in-memory part of) logging
+	const char line[] = "\033[32mgcc\033[m -c -O2 connector.cpp -o connector.o\r\n";
+	const int line_len = sizeof(line) - 1;
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		write_console(line, line_len);
+	bench_report("write_console", iterations, get_time_us() - t, (long long)iterations * line_len);
+
+	// write_output: the filter chain with built-in stages off should cost as little as write_console
+	bool progress_enabled = progress.enabled, sgr_enabled = sgr_min.enabled;
+	bool cwd_enabled = cwd_tracker.enabled, sync_enabled = sync_output.enabled, cmd_enabled = cmd_timing.enabled;
+	bool query_enabled = queries.enabled;
+	progress.enabled = sgr_min.enabled = cwd_tracker.enabled = sync_output.enabled = cmd_timing.enabled = false;
+	queries.enabled = false;
+	filter_chain_update();
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		write_output(line, line_len, wps_Output);
+	bench_report("write_output.passthrough", iterations, get_time_us() - t, (long long)iterations * line_len);
+	progress.enabled = progress_enabled; sgr_min.enabled = sgr_enabled;
+	cwd_tracker.enabled = cwd_enabled; sync_output.enabled = sync_enabled; cmd_timing.enabled = cmd_enabled;
+	queries.enabled = query_enabled;
+	filter_chain_update();
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		write_output(line, line_len, wps_Output);
+	bench_report("write_output.default", iterations, get_time_us() - t, (long long)iterations * line_len);
+
+	gnLogFileOut = open("/dev/null", O_WRONLY);
+	start_log_writer();
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		write_console(line, line_len);
+	bench_report("write_console.logging", iterations, get_time_us() - t, (long long)iterations * line_len);
+
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		log_system_time(true);
+	bench_report("log_system_time", iterations, get_time_us() - t, 0);
+	close_log_files();
+
+	// write_verbose: formatting of typical diagnostic line
+	t = get_time_us();
+	for (i = 0; i < iterations; ++i)
+		write_verbose("\033[31;40m{PID:%u} ioctl(%i,TIOCSWINSZ,(%i,%i)) succeeded (%i)\033[m\r\n", getpid(), pty_fd, 80, 25, 0);
+	bench_report("write_verbose", iterations, get_time_us() - t, 0);
+
+	// trigger scan: typical build log, few literal and regex triggers without matches
+	if (!trigger.count)
+	{
+		trigger_add("error:", false);
+		trigger_add("FAILED", false);
+		trigger_add("[Pp]assword( for [^ ]+)?: *$", true);
+	}
+	trigger_compile();
+	char* log_text = (char*)malloc(64*1024);
+	int log_len = 0;
+	while (log_len + line_len < 64*1024)
+	{
+		memcpy(log_text + log_len, line + 11, line_len - 11);
+		log_len += line_len - 11;
+	}
+	int scans = iterations / 100 + 1;
+	t = get_time_us();
+	for (i = 0; i < scans; ++i)
+		for (int pos = 0; pos < log_len; pos += trigger_scan(log_text + pos, log_len - pos))
+			;
+	bench_report("trigger.scan", scans, get_time_us() - t, (long long)scans * log_len);
+	free(log_text);
+	trigger.enabled = false;
+
+	safe_close(pty_fd);
+	memset(&Connector, 0, sizeof(Connector));
+	return 0;
+}
+
+// switch `--bench-pty [workload|all] [MB]` runs real producers behind our pty
+// and pumps their output by run() into the stub host sink
+static char* bench_make_file(const char* kind, long long size)
+{
+	const char* tmp = getenv("TMPDIR");
+	char* path = (char*)malloc(strlen(tmp ? tmp : "/tmp") + 64);
+	sprintf(path, "%s/connector-bench-%u-%s.txt", tmp ? tmp : "/tmp", getpid(), kind);
+	FILE* f = fopen(path, "wb");
+	if (!f)
+	{
+		perror(path);
+		free(path);
+		return NULL;
+	}
+
+	char line[20000];
+	long long written = 0;
+	for (unsigned n = 0; written < size; ++n)
+	{
+		int len = 0;
+		if (strcmp(kind, "ansi") == 0)
+		{
+			// compiler-like colored output, 256 and 24-bit colors
+			len = sprintf(line, "\033[1m%u.c:%u:%u:\033[m \033[1;31merror:\033[m \033[38;5;%um'sym_%u'\033[0m undeclared "
+				"\033[38;2;%u;%u;%um(first use)\033[m\033[K\r\n", n, n % 997, n % 80, n % 256, n, n % 256, (n * 7) % 256, (n * 13) % 256);
+		}
+		else if (strcmp(kind, "json") == 0)
+		{
+			// single long line of json per record
+			len = sprintf(line, "{\"id\":%u,\"items\":[", n);
+			for (int i = 0; i < 300; ++i)
+				len += sprintf(line + len, "%s{\"key\":\"k%u_%i\",\"value\":%u}", i ? "," : "", n, i, n * i);
+			len += sprintf(line + len, "]}\n");
+		}
+		else
+		{
+			len = sprintf(line, "%06u Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore\n", n);
+		}
+		fwrite(line, 1, len, f);
+		written += len;
+	}
+	fclose(f);
+	return path;
+}
+
+static int bench_pty_workload(const char* name, const char* cmd)
+{
+	struct rusage ru_start = {}, ru_end = {};
+	winsize winp = {25, 80};
+
+	memset(&Connector, 0, sizeof(Connector));
+	Connector.cbSize = sizeof(Connector);
+	Connector.ReadInput = bench_read_input;
+	Connector.WriteText = bench_write_text;
+	bench_records_count = 0;
+	termination = false;
+	pty_fd = -1;
+
+	pid = ce_forkpty(&pty_fd, NULL, &winp);
+	if (pid < 0)
+	{
+		child_err_msg("ce_forkpty failed");
+		return 3;
+	}
+	else if (!pid)
+	{
+		signal(SIGUSR1, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+		_exit(127);
+	}
+
+	fcntl(pty_fd, F_SETFL, O_NONBLOCK);
+	bench_written = 0;
+	memset(&pump_stats, 0, sizeof(pump_stats));
+	getrusage(RUSAGE_SELF, &ru_start);
+	long long t = get_time_us();
+
+	sigusr1_throw(pid);
+	run();
+
+	t = get_time_us() - t;
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	long long cpu_us = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) * 1000000LL + (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec)
+		+ (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1000000LL + (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec);
+	double mb = pump_stats.read_bytes / (1024.0 * 1024.0);
+	printf("%s,%llu,%.3f,%.1f,%.1f,%.1f,%.1f\n", name, pump_stats.read_bytes, t / 1000000.0,
+		t ? (mb * 1000000.0 / t) : 0.0, cpu_us / 1000.0,
+		mb ? ((pump_stats.selects + pump_stats.reads) / mb) : 0.0,
+		mb ? (pump_stats.write_texts / mb) : 0.0);
+	fflush(stdout);
+	return 0;
+}
+
+static int run_pty_benchmarks(const char* workload, int size_mb)
+{
+	if (size_mb <= 0)
+		size_mb = 16;
+	long long size = size_mb * 1024LL * 1024LL;
+	const char* kinds[] = {"yes", "seq", "cat", "ansi", "json"};
+	char cmd[MAX_PATH + 80];
+	int iRc = 0;
+
+	printf("workload,bytes,seconds,mb_per_s,connector_cpu_ms,syscalls_per_mb,writetext_per_mb\n");
+	fflush(stdout);
+
+	for (size_t k = 0; k < sizeof(kinds)/sizeof(kinds[0]) && !iRc; ++k)
+	{
+		const char* kind = kinds[k];
+		if (workload && strcmp(workload, "all") != 0 && strcmp(workload, kind) != 0)
+			continue;
+		char* file = NULL;
+		if (strcmp(kind, "yes") == 0)
+			sprintf(cmd, "yes | head -c %lld", size);
+		else if (strcmp(kind, "seq") == 0)
+			sprintf(cmd, "seq 1 1000000000 | head -c %lld", size);
+		else if ((file = bench_make_file((strcmp(kind, "cat") == 0) ? "text" : kind, size)) != NULL)
+			snprintf(cmd, sizeof(cmd), "cat '%s'", file);
+		else
+			continue;
+		iRc = bench_pty_workload(kind, cmd);
+		if (file)
+		{
+			unlink(file);
+			free(file);
+		}
+	}
+
+	memset(&Connector, 0, sizeof(Connector));
+	return iRc;
+}
+
+// switch `--bench-input [single|burst|repeat|all] [keys/s] [count]`
+// injects key events through the stand-in of Connector.ReadInput and measures
+// when they appear on the slave side of the pty, optionally under output flood
+struct BenchKey
+{
+	long long due_us;   // when the host would have the event ready
+	wchar_t ch;
+};
+static BenchKey* bench_keys = NULL;
+static int bench_keys_count = 0, bench_keys_next = 0;
+
+static ReadInputResult WINAPI bench_scripted_input(PINPUT_RECORD buffer, DWORD buffer_count, PDWORD result_count)
+{
+	long long now = get_time_us();
+	DWORD count = 0;
+	while (count < buffer_count && bench_keys_next < bench_keys_count && bench_keys[bench_keys_next].due_us <= now)
+		bench_key(buffer[count++], bench_keys[bench_keys_next++].ch, true);
+	*result_count = count;
+	if (!count)
+		return rir_None;
+	bool more = (bench_keys_next < bench_keys_count && bench_keys[bench_keys_next].due_us <= now);
+	return more ? rir_Ready_More : rir_Ready;
+}
+
+static int bench_compare_ll(const void* a, const void* b)
+{
+	long long d = *(const long long*)a - *(const long long*)b;
+	return (d < 0) ? -1 : (d > 0) ? 1 : 0;
+}
+
+// Child side: raw reader of the pty slave, reports arrival time of each byte
+static void bench_input_reader(int count, bool flood, int report_fd)
+{
+	struct termios raw = {};
+	tcgetattr(STDIN_FILENO, &raw);
+	raw.c_lflag &= ~(ICANON|ECHO|ISIG|IEXTEN);
+	raw.c_iflag &= ~(ICRNL|IXON);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+	pid_t producer = -1;
+	if (flood && (producer = fork()) == 0)
+	{
+		char block[4096];
+		for (int i = 0; i < (int)sizeof(block); ++i)
+			block[i] = ((i % 80) == 79) ? '\n' : ('a' + i % 26);
+		for (;;)
+			write(STDOUT_FILENO, block, sizeof(block));
+	}
+
+	// Report readiness, parent starts the clock
+	long long ready = get_time_us();
+	write(report_fd, &ready, sizeof(ready));
+
+	char data[64];
+	for (int received = 0; received < count;)
+	{
+		int len = read(STDIN_FILENO, data, sizeof(data));
+		if (len <= 0)
+			break;
+		long long now = get_time_us();
+		for (int i = 0; i < len && received < count; ++i, ++received)
+			write(report_fd, &now, sizeof(now));
+	}
+
+	if (producer > 0)
+		kill(producer, SIGKILL);
+	_exit(0);
+}
+
+static int bench_input_pattern(const char* pattern, int rate, int count, bool flood)
+{
+	int report[2];
+	if (pipe(report) != 0)
+	{
+		perror("pipe");
+		return 2;
+	}
+
+	memset(&Connector, 0, sizeof(Connector));
+	Connector.cbSize = sizeof(Connector);
+	Connector.ReadInput = bench_scripted_input;
+	Connector.WriteText = bench_write_text;
+	termination = false;
+	pty_fd = -1;
+
+	bench_keys = (BenchKey*)calloc(count, sizeof(*bench_keys));
+	bench_keys_count = count;
+	bench_keys_next = count; // nothing is due before the reader is ready
+
+	winsize winp = {25, 80};
+	pid = ce_forkpty(&pty_fd, NULL, &winp);
+	if (pid < 0)
+	{
+		child_err_msg("ce_forkpty failed");
+		close(report[0]);
+		close(report[1]);
+		free(bench_keys);
+		bench_keys = NULL;
+		bench_keys_count = bench_keys_next = 0;
+		return 3;
+	}
+	else if (!pid)
+	{
+		close(report[0]);
+		bench_input_reader(count, flood, report[1]);
+	}
+
+	close(report[1]);
+	fcntl(pty_fd, F_SETFL, O_NONBLOCK);
+	sigusr1_throw(pid);
+
+	long long start = 0;
+	read(report[0], &start, sizeof(start));
+	// schedule events
+	const int burst = 8;
+	long long period = 1000000LL / ((rate > 0) ? rate : 1);
+	start += 50000;
+	for (int i = 0; i < count; ++i)
+	{
+		if (strcmp(pattern, "burst") == 0)
+			bench_keys[i].due_us = start + (i / burst) * period;
+		else
+			bench_keys[i].due_us = start + i * period;
+		bench_keys[i].ch = (strcmp(pattern, "repeat") == 0) ? 'x' : ('a' + i % 26);
+	}
+	bench_keys_next = 0;
+
+	// read the reports in background while the loop is running, pipe buffer is limited
+	pid_t collector = -1;
+	int collected[2];
+	if (pipe(collected) == 0 && (collector = fork()) == 0)
+	{
+		close(collected[0]);
+		close(pty_fd);
+		long long arrived;
+		while (read(report[0], &arrived, sizeof(arrived)) == sizeof(arrived))
+			write(collected[1], &arrived, sizeof(arrived));
+		_exit(0);
+	}
+	close(collected[1]);
+
+	run();
+
+	long long* latency = (long long*)calloc(count, sizeof(*latency));
+	int got = 0;
+	long long arrived;
+	FILE* f = fdopen(collected[0], "rb");
+	while (got < count && f && fread(&arrived, sizeof(arrived), 1, f) == 1)
+	{
+		latency[got] = arrived - bench_keys[got].due_us;
+		++got;
+	}
+	if (f)
+		fclose(f);
+	close(report[0]);
+	if (collector > 0)
+		waitpid(collector, NULL, 0);
+
+	qsort(latency, got, sizeof(*latency), bench_compare_ll);
+	printf("%s,%s,%i,%i,%lld,%lld,%lld,%lld\n", pattern, flood ? "flood" : "idle", rate, got,
+		got ? latency[got / 2] : 0LL, got ? latency[got * 9 / 10] : 0LL,
+		got ? latency[got * 99 / 100] : 0LL, got ? latency[got - 1] : 0LL);
+	fflush(stdout);
+
+	free(latency);
+	free(bench_keys);
+	bench_keys = NULL;
+	bench_keys_count = bench_keys_next = 0;
+	return (got == count) ? 0 : 4;
+}
+
+static int run_input_benchmarks(const char* pattern, int rate, int count)
+{
+	const char* patterns[] = {"single", "burst", "repeat"};
+	const int default_rates[] = {10, 5, 30};
+	int iRc = 0;
+
+	if (count <= 0)
+		count = 200;
+
+	printf("pattern,output,keys_per_s,keys,p50_us,p90_us,p99_us,max_us\n");
+	fflush(stdout);
+
+	for (size_t p = 0; p < sizeof(patterns)/sizeof(patterns[0]); ++p)
+	{
+		if (pattern && strcmp(pattern, "all") != 0 && strcmp(pattern, patterns[p]) != 0)
+			continue;
+		for (int flood = 0; flood <= 1; ++flood)
+		{
+			int rc = bench_input_pattern(patterns[p], (rate > 0) ? rate : default_rates[p], count, flood != 0);
+			if (rc)
+				iRc = rc;
+		}
+	}
+
+	memset(&Connector, 0, sizeof(Connector));
+	return iRc;
+}
+
+// switch `--simulate <script>` replays the pump against scripted stand-ins of the shell
+// and of the host on the virtual clock: time moves only when the pump waits, so the
+// batching, coalescing and timeout policies give the same result on every run,
+// and faster than real time. Switches given before `--simulate` are applied.
+// Script lines, times are milliseconds from the start:
+//   echo <ms>          the shell echoes typed keys after the delay (CR as CR LF)
+//   <ms> out <text>    the shell prints the text
+//   <ms> key <text>    keys typed in the terminal, one event per (ASCII) character
+//   <ms> close         the shell closes the pty, the pty is closed after the last event anyway
+//   <ms> hide|show     the host hides or shows the tab
+// Text accepts \r \n \t \e \a \\ \xNN escapes. Every event is printed to stdout as
+// "<ms> <who> <bytes> <text>", `who` is out/echo (shell), host (WriteText) or pty (our input).
+#define SIM_ECHO_MAX 256
+enum SimEventType
+{
+	se_Out,
+	se_Key,
+	se_Close,
+	se_Hide,
+	se_Show,
+};
+struct SimEvent
+{
+	long long due_us;
+	SimEventType type;
+	char* data;
+	int len;
+};
+struct SimEcho
+{
+	long long due_us;
+	char data[32];
+	int len;
+};
+struct Simulation
+{
+	long long now_us;
+	int shell_fd;                   // shell side of the pty stand-in
+	SimEvent* events;
+	int count;
+	int next_out;                   // next out or close event
+	int next_key, key_pos;          // next key event and its character
+	long long echo_us;              // echo delay, -1 if the shell does not echo
+	SimEcho echo[SIM_ECHO_MAX];
+	int echo_head, echo_count;
+	bool hidden;                    // the tab is hidden by the host
+	unsigned host_writes;
+	long long host_bytes, pty_bytes;
+};
+static Simulation sim = {};
+
+static long long sim_time_us()
+{
+	return sim.now_us;
+}
+
+static long long sim_realtime_ms()
+{
+	return sim.now_us / 1000;
+}
+
+static void sim_print(const char* who, const char* data, int len)
+{
+	char text[256];
+	int used = 0;
+	for (int i = 0; i < len && used < (int)sizeof(text) - 8; ++i)
+	{
+		unsigned char c = (unsigned char)data[i];
+		switch (c)
+		{
+		case '\r': used += sprintf(text + used, "\\r"); break;
+		case '\n': used += sprintf(text + used, "\\n"); break;
+		case '\t': used += sprintf(text + used, "\\t"); break;
+		case 27: used += sprintf(text + used, "\\e"); break;
+		case '\\': used += sprintf(text + used, "\\\\"); break;
+		default:
+			if (c < 0x20 || c >= 0x7F)
+				used += sprintf(text + used, "\\x%02X", c);
+			else
+				text[used++] = c;
+		}
+	}
+	text[used] = 0;
+	printf("%lld.%03i %s %i %s%s\n", sim.now_us / 1000, (int)(sim.now_us % 1000), who, len, text,
+		(used >= (int)sizeof(text) - 8) ? "..." : "");
+}
+
+static BOOL WINAPI sim_write_text(LPCSTR pBuffer, DWORD cbWrite, PDWORD pcbWritten, WriteProcessedStream nStream)
+{
+	if (cbWrite == (DWORD)-1)
+		cbWrite = strlen(pBuffer);
+	sim.host_writes++;
+	sim.host_bytes += cbWrite;
+	sim_print("host", pBuffer, cbWrite);
+	*pcbWritten = cbWrite;
+	return TRUE;
+}
+
+static BOOL WINAPI sim_is_tab_visible()
+{
+	return !sim.hidden;
+}
+
+static ReadInputResult WINAPI sim_read_input(PINPUT_RECORD buffer, DWORD buffer_count, PDWORD result_count)
+{
+	DWORD count = 0;
+	for (; count < buffer_count && sim.next_key < sim.count; sim.next_key++, sim.key_pos = 0)
+	{
+		const SimEvent& ev = sim.events[sim.next_key];
+		if (ev.type != se_Key)
+			continue;
+		if (ev.due_us > sim.now_us)
+			break;
+		while (count < buffer_count && sim.key_pos < ev.len)
+			bench_key(buffer[count++], (unsigned char)ev.data[sim.key_pos++], true);
+		if (sim.key_pos < ev.len)
+			break;
+	}
+	*result_count = count;
+	if (!count)
+		return rir_None;
+	bool more = (sim.next_key < sim.count && sim.events[sim.next_key].due_us <= sim.now_us);
+	return more ? rir_Ready_More : rir_Ready;
+}
+
+// Read what the pump wrote into the pty, the shell echoes it later
+static void sim_take_input()
+{
+	char data[16];
+	int len;
+	while (sim.shell_fd >= 0 && (len = read(sim.shell_fd, data, sizeof(data))) > 0)
+	{
+		sim.pty_bytes += len;
+		sim_print("pty", data, len);
+		if (sim.echo_us < 0 || sim.echo_count >= SIM_ECHO_MAX)
+			continue;
+		SimEcho& echo = sim.echo[(sim.echo_head + sim.echo_count++) % SIM_ECHO_MAX];
+		echo.due_us = sim.now_us + sim.echo_us;
+		echo.len = 0;
+		for (int i = 0; i < len; ++i)
+		{
+			echo.data[echo.len++] = data[i];
+			if (data[i] == '\r')
+				echo.data[echo.len++] = '\n';
+		}
+	}
+}
+
+static void sim_shell_write(const char* who, const char* data, int len)
+{
+	sim_print(who, data, len);
+	if (sim.shell_fd >= 0)
+		write(sim.shell_fd, data, len);
+}
+
+static void sim_shell_close()
+{
+	if (sim.shell_fd < 0)
+		return;
+	sim_print("close", "", 0);
+	close(sim.shell_fd);
+	sim.shell_fd = -1;
+}
+
+// Time of the next shell event, -1 if there is nothing to wait for
+static long long sim_next_due()
+{
+	long long due = -1;
+	while (sim.next_out < sim.count && sim.events[sim.next_out].type == se_Key)
+		sim.next_out++;
+	if (sim.next_out < sim.count)
+		due = sim.events[sim.next_out].due_us;
+	if (sim.echo_count && (due < 0 || sim.echo[sim.echo_head].due_us < due))
+		due = sim.echo[sim.echo_head].due_us;
+	return due;
+}
+
+static void sim_fire_due()
+{
+	while (sim.echo_count && sim.echo[sim.echo_head].due_us <= sim.now_us)
+	{
+		const SimEcho& echo = sim.echo[sim.echo_head];
+		sim_shell_write("echo", echo.data, echo.len);
+		sim.echo_head = (sim.echo_head + 1) % SIM_ECHO_MAX;
+		sim.echo_count--;
+	}
+	for (; sim.next_out < sim.count && sim.events[sim.next_out].due_us <= sim.now_us; sim.next_out++)
+	{
+		const SimEvent& ev = sim.events[sim.next_out];
+		if (ev.type == se_Out)
+			sim_shell_write("out", ev.data, ev.len);
+		else if (ev.type == se_Close)
+			sim_shell_close();
+		else if (ev.type == se_Hide || ev.type == se_Show)
+		{
+			sim.hidden = (ev.type == se_Hide);
+			sim_print(sim.hidden ? "hide" : "show", "", 0);
+		}
+	}
+}
+
+// Stand-in of select(): the clock jumps to the next shell event or to the timeout
+static int sim_wait(int nfds, fd_set* readfds, long long timeout_us)
+{
+	long long deadline = sim.now_us + timeout_us;
+	for (;;)
+	{
+		sim_take_input();
+		fd_set ready = *readfds;
+		struct timeval zero = {};
+		int rc = select(nfds, &ready, 0, 0, &zero);
+		if (rc != 0)
+		{
+			*readfds = ready;
+			return rc;
+		}
+		long long due = sim_next_due();
+		if (due < 0 && sim.next_key >= sim.count)
+		{
+			// the script is over
+			sim_shell_close();
+			continue;
+		}
+		if (due < 0 || due > deadline)
+		{
+			sim.now_us = deadline;
+			FD_ZERO(readfds);
+			return 0;
+		}
+		sim.now_us = _max(sim.now_us, due);
+		sim_fire_due();
+	}
+}
+
+static int sim_unescape(char* text)
+{
+	char* dst = text;
+	for (const char* src = text; *src; ++src)
+	{
+		if (*src != '\\' || !src[1])
+		{
+			*(dst++) = *src;
+			continue;
+		}
+		switch (*(++src))
+		{
+		case 'r': *(dst++) = '\r'; break;
+		case 'n': *(dst++) = '\n'; break;
+		case 't': *(dst++) = '\t'; break;
+		case 'e': *(dst++) = 27; break;
+		case 'a': *(dst++) = 7; break;
+		case 'x':
+			if (isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2]))
+			{
+				char hex[3] = {src[1], src[2], 0};
+				*(dst++) = (char)strtol(hex, NULL, 16);
+				src += 2;
+				break;
+			}
+			// fall through
+		default: *(dst++) = *src;
+		}
+	}
+	return (int)(dst - text);
+}
+
+static bool sim_load(const char* path)
+{
+	FILE* f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	if (!f)
+	{
+		printf("{PID:%u} --simulate: can't open `%s`: %s\r\n", getpid(), path, strerror(errno));
+		return false;
+	}
+	static char line[64*1024];
+	int line_no = 0, max_count = 0;
+	long long last_us = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), f))
+	{
+		line_no++;
+		int len = strlen(line);
+		if (len == (int)sizeof(line) - 1 && line[len-1] != '\n')
+		{
+			printf("{PID:%u} --simulate: line %i: too long\r\n", getpid(), line_no);
+			ok = false;
+			break;
+		}
+		while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = 0;
+		char* p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p || *p == '#')
+			continue;
+		if (strncmp(p, "echo ", 5) == 0)
+		{
+			sim.echo_us = (long long)(atof(p + 5) * 1000);
+			continue;
+		}
+
+		char* cmd = NULL;
+		double ms = strtod(p, &cmd);
+		while (*cmd == ' ' || *cmd == '\t')
+			cmd++;
+		char* text = strchr(cmd, ' ');
+		if (text)
+			*(text++) = 0;
+		SimEvent ev = {(long long)(ms * 1000), se_Out};
+		if (strcmp(cmd, "out") == 0)
+			ev.type = se_Out;
+		else if (strcmp(cmd, "key") == 0)
+			ev.type = se_Key;
+		else if (strcmp(cmd, "close") == 0)
+			ev.type = se_Close;
+		else if (strcmp(cmd, "hide") == 0)
+			ev.type = se_Hide;
+		else if (strcmp(cmd, "show") == 0)
+			ev.type = se_Show;
+		else
+		{
+			printf("{PID:%u} --simulate: line %i: unknown event `%s`\r\n", getpid(), line_no, cmd);
+			ok = false;
+			break;
+		}
+		if (cmd == p || ev.due_us < last_us)
+		{
+			printf("{PID:%u} --simulate: line %i: time must not decrease\r\n", getpid(), line_no);
+			ok = false;
+			break;
+		}
+		last_us = ev.due_us;
+		if (ev.type == se_Out || ev.type == se_Key)
+		{
+			ev.len = text ? sim_unescape(text) : 0;
+			ev.data = (char*)malloc(ev.len + 1);
+			memcpy(ev.data, text ? text : "", ev.len);
+		}
+		if (sim.count == max_count)
+		{
+			max_count = max_count ? (max_count * 2) : 64;
+			sim.events = (SimEvent*)realloc(sim.events, max_count * sizeof(*sim.events));
+		}
+		sim.events[sim.count++] = ev;
+	}
+	if (f != stdin)
+		fclose(f);
+	return ok;
+}
+
+static int run_simulation(const char* path)
+{
+	sim.echo_us = -1;
+	if (!sim_load(path))
+		return 2;
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+	{
+		perror("socketpair");
+		return 2;
+	}
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	pty_fd = sv[0];
+	sim.shell_fd = sv[1];
+	pty_err = -1;
+	pid = 0;
+
+	memset(&Connector, 0, sizeof(Connector));
+	Connector.cbSize = sizeof(Connector);
+	Connector.ReadInput = sim_read_input;
+	Connector.WriteText = sim_write_text;
+	Connector.IsTabVisible = sim_is_tab_visible;
+	PumpClock virtual_clock = {sim_time_us, sim_realtime_ms, sim_wait};
+	pump_clock = virtual_clock;
+
+	run();
+
+	printf("# virtual_ms=%lld host.writes=%u host.bytes=%lld pty.bytes=%lld\n",
+		sim.now_us / 1000, sim.host_writes, sim.host_bytes, sim.pty_bytes);
+	fflush(stdout);
+	return 0;
+}
+
+// Unpack LZ4 blocks till the frame EndMark
+static int cat_lz4_blocks(FILE* f, const char* path, unsigned char flg, char* packed, char* unpacked, int max_block)
+{
+	for (;;)
+	{
+		unsigned char size_buf[4];
+		if (fread(size_buf, 1, 4, f) != 4)
+			return 0; // truncated log, session was not finished properly
+		unsigned size = lz4_read32(size_buf);
+		if (size == 0)
+			return 0;
+		bool raw = (size & LZ4F_UNCOMPRESSED) != 0;
+		size &= ~LZ4F_UNCOMPRESSED;
+		if ((int)size > max_block || fread(packed, 1, size, f) != size)
+		{
+			fprintf(stderr, "`%s`: corrupted LZ4 block\n", path);
+			return 3;
+		}
+		if (flg & 0x10)
+			fseek(f, 4, SEEK_CUR); // block checksum
+		if (raw)
+		{
+			fwrite(packed, 1, size, stdout);
+		}
+		else
+		{
+			int len = lz4_decompress_block(packed, size, unpacked, max_block);
+			if (len < 0)
+			{
+				fprintf(stderr, "`%s`: corrupted LZ4 block\n", path);
+				return 3;
+			}
+			fwrite(unpacked, 1, len, stdout);
+		}
+	}
+}
+
+// switch `--sgr-check [file]` verifies the SGR minimizer: the file (or generated
+// sample) is passed through the output stage in pty-sized reads, then both streams
+// are interpreted and the rendition of every printed byte is compared
+static char* sgr_check_out = NULL;
+static int sgr_check_len = 0, sgr_check_size = 0;
+
+static BOOL WINAPI sgr_check_write_text(LPCSTR pBuffer, DWORD cbWrite, PDWORD pcbWritten, WriteProcessedStream nStream)
+{
+	if (cbWrite == (DWORD)-1)
+		cbWrite = strlen(pBuffer);
+	if (sgr_check_len + (int)cbWrite > sgr_check_size)
+	{
+		sgr_check_size = _max(sgr_check_size * 2, sgr_check_len + (int)cbWrite);
+		sgr_check_out = (char*)realloc(sgr_check_out, sgr_check_size);
+	}
+	memcpy(sgr_check_out + sgr_check_len, pBuffer, cbWrite);
+	sgr_check_len += cbWrite;
+	*pcbWritten = cbWrite;
+	return TRUE;
+}
+
+// Reference interpreter of the rendition for `--sgr-check`, it does not share
+// the state model of the minimizer: every SGR code is kept as the host would
+// see it, unknown codes are folded into `extras` in order
+struct SgrCheckPen
+{
+	unsigned char on[10];       // codes 1..9
+	int fg[4], bg[4];           // 0: default; 3x/9x: {1,code}; 38;5: {5,n}; 38;2: {2,r,g,b}
+	unsigned long long extras;  // hash of unknown codes since the last reset
+};
+struct SgrCheckStream
+{
+	VtScanner* vs;
+	const char *p, *end;
+	VtToken tok;
+	int tok_pos;
+	bool more;
+	SgrCheckPen pen, saved;
+};
+
+static const SgrCheckPen sgr_check_default = {};
+
+static bool sgr_check_pen_equal(const SgrCheckPen& a, const SgrCheckPen& b)
+{
+	return memcmp(a.on, b.on, sizeof(a.on)) == 0 && memcmp(a.fg, b.fg, sizeof(a.fg)) == 0
+		&& memcmp(a.bg, b.bg, sizeof(a.bg)) == 0 && a.extras == b.extras;
+}
+
+static void sgr_check_extra(SgrCheckPen& pen, const char* code, int len)
+{
+	pen.extras = (pen.extras ^ ';') * 1099511628211ULL;
+	for (int i = 0; i < len; ++i)
+		pen.extras = (pen.extras ^ (unsigned char)code[i]) * 1099511628211ULL;
+}
+
+static void sgr_check_sgr(SgrCheckPen& pen, const char* p, const char* end)
+{
+	int codes[32], count = 0;
+	const char* code_ptr[32];
+	int code_len[32];
+	// split "a;b;c", empty code is 0, codes with ':' are unknown
+	for (const char* c = p; c <= end && count < 32; ++c)
+	{
+		const char* e = c;
+		while (e < end && *e != ';')
+			++e;
+		code_ptr[count] = c;
+		code_len[count] = e - c;
+		codes[count] = memchr(c, ':', e - c) ? -1 : atoi(c);
+		++count;
+		c = e;
+	}
+	for (int i = 0; i < count; ++i)
+	{
+		int code = codes[i];
+		int* color = (code == 38) ? pen.fg : (code == 48) ? pen.bg : NULL;
+		if (code == 0)
+		{
+			pen = sgr_check_default;
+		}
+		else if (code >= 1 && code <= 9 && code != 6)
+		{
+			pen.on[code] = 1;
+		}
+		else if (code == 22)
+		{
+			pen.on[1] = pen.on[2] = 0;
+		}
+		else if (code >= 23 && code <= 29 && code != 26)
+		{
+			pen.on[code - 20] = 0;
+		}
+		else if ((code >= 30 && code <= 37) || (code >= 90 && code <= 97))
+		{
+			pen.fg[0] = 1; pen.fg[1] = code; pen.fg[2] = pen.fg[3] = 0;
+		}
+		else if ((code >= 40 && code <= 47) || (code >= 100 && code <= 107))
+		{
+			pen.bg[0] = 1; pen.bg[1] = code - 10; pen.bg[2] = pen.bg[3] = 0;
+		}
+		else if (code == 39 || code == 49)
+		{
+			memset((code == 39) ? pen.fg : pen.bg, 0, sizeof(pen.fg));
+		}
+		else if (color && i + 2 < count && codes[i+1] == 5 && codes[i+2] >= 0 && codes[i+2] <= 255)
+		{
+			color[0] = 5; color[1] = codes[i+2]; color[2] = color[3] = 0;
+			i += 2;
+		}
+		else if (color && i + 4 < count && codes[i+1] == 2 && codes[i+2] >= 0 && codes[i+2] <= 255
+			&& codes[i+3] >= 0 && codes[i+3] <= 255 && codes[i+4] >= 0 && codes[i+4] <= 255)
+		{
+			color[0] = 2; color[1] = codes[i+2]; color[2] = codes[i+3]; color[3] = codes[i+4];
+			i += 4;
+		}
+		else
+		{
+			// the rest of the sequence is not understood
+			for (; i < count; ++i)
+				sgr_check_extra(pen, code_ptr[i], code_len[i]);
+		}
+	}
+}
+
+// Returns true if the token changed the rendition and prints nothing
+static bool sgr_check_token(SgrCheckStream& cs, const VtToken& tok)
+{
+	const char* body = tok.ptr + 2;
+	const char* end = tok.ptr + tok.len - 1;
+	char last = *end;
+	if (tok.type == vt_Esc && tok.len == 2)
+	{
+		if (tok.ptr[1] == '7')
+			cs.saved = cs.pen;
+		else if (tok.ptr[1] == '8')
+			cs.pen = cs.saved;
+		else if (tok.ptr[1] == 'c')
+			cs.pen = cs.saved = sgr_check_default;
+		return false;
+	}
+	if (tok.type != vt_CSI)
+		return false;
+	bool plain = true; // no private prefix and no intermediates
+	for (const char* c = body; c < end; ++c)
+		if (!((*c >= '0' && *c <= '9') || *c == ';' || *c == ':'))
+			plain = false;
+	if (last == 'm' && plain)
+	{
+		sgr_check_sgr(cs.pen, body, end);
+		return true;
+	}
+	if (body == end && last == 's')
+		cs.saved = cs.pen;
+	else if (body == end && last == 'u')
+		cs.pen = cs.saved;
+	else if (end - body == 1 && *body == '!' && last == 'p')
+		cs.pen = cs.saved = sgr_check_default;
+	else if (*body == '?' && (last == 'h' || last == 'l'))
+	{
+		for (const char* c = body + 1; c < end; ++c)
+		{
+			int mode = atoi(c);
+			if (mode == 1048 || mode == 1049)
+			{
+				if (last == 'h')
+					cs.saved = cs.pen;
+				else
+					cs.pen = cs.saved;
+				break;
+			}
+			while (c < end && *c != ';')
+				++c;
+		}
+	}
+	return false;
+}
+
+// Next printed byte (everything except SGR) and its rendition
+static bool sgr_check_next(SgrCheckStream& cs, char& c)
+{
+	while (cs.tok_pos >= cs.tok.len)
+	{
+		if (!cs.more)
+			return false;
+		cs.more = vt_next(*cs.vs, cs.p, cs.end, cs.tok) || vt_flush(*cs.vs, cs.tok);
+		if (!cs.more)
+			return false;
+		cs.tok_pos = sgr_check_token(cs, cs.tok) ? cs.tok.len : 0;
+	}
+	c = cs.tok.ptr[cs.tok_pos++];
+	return true;
+}
+
+static void sgr_check_open(SgrCheckStream& cs, const char* data, int len)
+{
+	memset(&cs, 0, sizeof(cs));
+	cs.vs = (VtScanner*)calloc(1, sizeof(VtScanner));
+	cs.p = data;
+	cs.end = data + len;
+	cs.more = true;
+}
+
+static void sgr_check_print_pen(const char* title, const SgrCheckPen& pen)
+{
+	printf("sgr-check:   %s on=%i%i%i%i%i%i%i%i%i fg=%i:%i:%i:%i bg=%i:%i:%i:%i extras=%llX\n", title,
+		pen.on[1], pen.on[2], pen.on[3], pen.on[4], pen.on[5], pen.on[6], pen.on[7], pen.on[8], pen.on[9],
+		pen.fg[0], pen.fg[1], pen.fg[2], pen.fg[3], pen.bg[0], pen.bg[1], pen.bg[2], pen.bg[3], pen.extras);
+}
+
+static char* sgr_check_sample(int& len)
+{
+	const char* pieces[] = {
+		"\033[0m\033[01;34mdir\033[0m  ", "\033[0m\033[01;32mexec\033[0m  ", "plain  ",
+		"\033[1m\033[31merror:\033[0m\033[1m something failed\033[0m\r\n",
+		"\033[38;2;10;20;30mX\033[38;2;10;20;30mY\033[38;2;10;20;31mZ", "\033[0m\033[0m\033[m",
+		"\033[38;5;208m\033[48;5;17mindexed\033[39;49m ", "\033[4m\033[24m\033[4mu\033[0m",
+		"\033[53moverline\033[0m", "\033[4:3mcurly\033[0m", "\033[2;1mfaint-bold\033[22m",
+		"\033[7;8;9m\033[27;28;29mflags ", "\033[92;103mbright\033[0;39m\r\n", "\033[K\033[2J\033[H",
+		"\033[1;31m\033[1;31m\033[1;31mrepeated\033[0m ", "\033]0;title\007", "\033[3m\033[23m\033[5mb\033[25m",
+		"\0337\033[1mA\0338\033[1mB", "\033[s\033[32mC\033[u\033[32mD", "\033[?1049h\033[35mE\033[?1049l\033[35mF",
+		"\033[1;44m\033c\033[1;44mG", "\033[7m\033[!p\033[7mH", "\0338\033[m",
+	};
+	const int count = sizeof(pieces)/sizeof(pieces[0]);
+	int size = 4*1024*1024;
+	char* sample = (char*)malloc(size);
+	len = 0;
+	srand(2026);
+	while (sample)
+	{
+		const char* piece = pieces[rand() % count];
+		int piece_len = strlen(piece);
+		if (len + piece_len > size)
+			break;
+		memcpy(sample + len, piece, piece_len);
+		len += piece_len;
+	}
+	return sample;
+}
+
+static int run_sgr_check(const char* path)
+{
+	int len = 0;
+	char* data = NULL;
+	if (path)
+	{
+		FILE* f = fopen(path, "rb");
+		if (!f)
+		{
+			fprintf(stderr, "Can't open `%s`: %s\n", path, strerror(errno));
+			return 2;
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		data = (char*)malloc(len + 1);
+		if (!data || (int)fread(data, 1, len, f) != len)
+			len = 0;
+		fclose(f);
+	}
+	else
+	{
+		data = sgr_check_sample(len);
+	}
+
+	memset(&Connector, 0, sizeof(Connector));
+	Connector.cbSize = sizeof(Connector);
+	Connector.WriteText = sgr_check_write_text;
+	pid = 0;
+	sgr_min.enabled = true;
+	sync_output.enabled = false;
+	cwd_tracker.enabled = false;
+
+	const int bufCount = 4096;
+	for (int pos = 0; pos < len; pos += bufCount)
+		write_output(data + pos, _min(bufCount, len - pos), wps_Output);
+	output_idle();
+
+	printf("sgr-check: input=%i output=%i saved=%i (%.1f%%) sequences=%llu merged=%llu\n",
+		len, sgr_check_len, len - sgr_check_len, len ? (len - sgr_check_len) * 100.0 / len : 0.0,
+		sgr_min.seqs, sgr_min.dropped);
+
+	// Both streams are interpreted in lockstep
+	SgrCheckStream in, out;
+	sgr_check_open(in, data, len);
+	sgr_check_open(out, sgr_check_out, sgr_check_len);
+	int iRc = 0, count = 0;
+	for (;; ++count)
+	{
+		char c_in = 0, c_out = 0;
+		bool has_in = sgr_check_next(in, c_in), has_out = sgr_check_next(out, c_out);
+		if (!has_in && !has_out)
+			break;
+		if (has_in != has_out || c_in != c_out)
+		{
+			printf("sgr-check: FAILED, printed text differs at byte %i\n", count);
+			iRc = 1;
+			break;
+		}
+		if (!sgr_check_pen_equal(in.pen, out.pen))
+		{
+			printf("sgr-check: FAILED at printed byte %i\n", count);
+			sgr_check_print_pen("input: ", in.pen);
+			sgr_check_print_pen("output:", out.pen);
+			iRc = 1;
+			break;
+		}
+	}
+	if (!iRc && !sgr_check_pen_equal(in.pen, out.pen))
+	{
+		printf("sgr-check: FAILED, final rendition differs\n");
+		iRc = 1;
+	}
+	if (!iRc)
+		printf("sgr-check: OK, %i printed bytes have the same rendition\n", count);
+
+	free(in.vs); free(out.vs);
+	free(data);
+	return iRc;
+}
+
+// switch `--cat-log <file>` prints the log file, LZ4-compressed logs are unpacked
+static int cat_log_file(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Can't open `%s`: %s\n", path, strerror(errno));
+		return 2;
+	}
+
+	int iRc = 0;
+	const int max_block = 4*1024*1024;
+	char* packed = (char*)malloc(max_block);
+	char* unpacked = (char*)malloc(max_block);
+	unsigned char hdr[4];
+	size_t hdr_len = fread(hdr, 1, sizeof(hdr), f);
+
+	if (hdr_len < sizeof(hdr) || lz4_read32(hdr) != LZ4F_MAGIC)
+	{
+		// Plain log file
+		fwrite(hdr, 1, hdr_len, stdout);
+		size_t len;
+		while ((len = fread(packed, 1, max_block, f)) > 0)
+			fwrite(packed, 1, len, stdout);
+	}
+	else for (;;)
+	{
+		unsigned char flg_bd[2];
+		if (fread(flg_bd, 1, 2, f) != 2 || (flg_bd[0] >> 6) != 1)
+		{
+			fprintf(stderr, "`%s`: unsupported LZ4 frame header\n", path);
+			iRc = 3; break;
+		}
+		if (!(flg_bd[0] & 0x20))
+		{
+			fprintf(stderr, "`%s`: LZ4 frames with linked blocks are not supported\n", path);
+			iRc = 3; break;
+		}
+		// skip optional content size and dictionary id, then header checksum
+		fseek(f, ((flg_bd[0] & 0x08) ? 8 : 0) + ((flg_bd[0] & 0x01) ? 4 : 0) + 1, SEEK_CUR);
+
+		iRc = cat_lz4_blocks(f, path, flg_bd[0], packed, unpacked, max_block);
+		if (iRc == 0 && (flg_bd[0] & 0x04))
+			fseek(f, 4, SEEK_CUR); // content checksum
+
+		// Concatenated frames are allowed, zero padding is not a frame
+		if (iRc || fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || lz4_read32(hdr) != LZ4F_MAGIC)
+			break;
+	}
+
+	free(packed);
+	free(unpacked);
+	fclose(f);
+	return iRc;
+}
+
+// Find the last keyframe not after `pos` (offset or hh:mm:ss) in the index,
+// returns the exit code of `--log-seek`
+static int seek_log_index(const char* idx_name, const char* pos, LogIndexRecord& rec, long long& found)
+{
+	int idx_fd = open(idx_name, O_RDONLY);
+	char magic[sizeof(LOG_INDEX_MAGIC)] = "";
+	if (idx_fd < 0 || read(idx_fd, magic, sizeof(magic) - 1) != sizeof(magic) - 1 || strcmp(magic, LOG_INDEX_MAGIC) != 0)
+	{
+		fprintf(stderr, "Can't open index `%s`\n", idx_name);
+		if (idx_fd >= 0)
+			close(idx_fd);
+		return 2;
+	}
+	long long count = (lseek(idx_fd, 0, SEEK_END) - (sizeof(LOG_INDEX_MAGIC) - 1)) / LOG_INDEX_RECORD;
+
+	// Target is the byte offset or the local time of day
+	long long target = 0;
+	bool by_time = (strchr(pos, ':') != NULL);
+	if (by_time)
+	{
+		int h = 0, m = 0;
+		double sec = 0;
+		sscanf(pos, "%i:%i:%lf", &h, &m, &sec);
+		if (!count || !log_read_index(idx_fd, 0, rec))
 		{
-			if (check_child() == -1)
-			{
-				if (pty_fd < 0)
-					break;
-			}
-			else
-			{
-				// Pty gone, but process still there: keep checking?
-			}
+			fprintf(stderr, "Index `%s` is empty\n", idx_name);
+			close(idx_fd);
+			return 2;
 		}
+		time_t first = (time_t)(rec.time_ms / 1000);
+		struct tm day = *localtime(&first);
+		day.tm_hour = h; day.tm_min = m; day.tm_sec = (int)sec;
+		target = (long long)mktime(&day) * 1000 + (long long)((sec - (int)sec) * 1000);
+		if (target < rec.time_ms)
+			target += 24 * 3600 * 1000LL; // session crossed midnight
+	}
+	else
+	{
+		target = atoll(pos);
+	}
 
-		const int fdsmax = _max(pty_fd,pty_err) + 1;
-		debug_log_format("%u:PID=%u:TID=%u: calling select on (%i,%i)\n", GetTickCount(), getpid(), GetCurrentThreadId(), pty_fd, pty_err);
-		timeout.tv_usec = 10000;
-		if (select(fdsmax, &fds, 0, 0, &timeout) > 0)
+	// Binary search
+	long long lo = 0, hi = count - 1;
+	found = -1;
+	while (lo <= hi)
+	{
+		long long mid = (lo + hi) / 2;
+		if (!log_read_index(idx_fd, mid, rec))
+			break;
+		if ((by_time ? rec.time_ms : rec.offset) <= target)
 		{
-			if (pty_fd >= 0 && FD_ISSET(pty_fd, &fds))
-			{
-				process_pty(pty_fd, buf, bufCount, preferredCount);
-				if (verbose && (pty_fd < 0))
-					write_verbose("\r\n\033[31;40m{PID:%u} pty_fd set to -1\033[m\r\n", getpid(), pid);
-			}
-
-			if (pty_err >= 0 && FD_ISSET(pty_err, &fds))
-			{
-				process_pty(pty_err, buf, bufCount, preferredCount);
-				if (verbose && (pty_err < 0))
-					write_verbose("\r\n\033[31;40m{PID:%u} pty_err set to -1\033[m\r\n", getpid(), pid);
-			}
+			found = mid;
+			lo = mid + 1;
 		}
 		else
 		{
-			debug_log_format("%u:PID=%u:TID=%u: select failed\n", GetTickCount(), getpid(), GetCurrentThreadId());
-		}
-
-		DWORD start_tick = GetTickCount(), end_tick;
-		while (read_input())
-		{
-			end_tick = GetTickCount();
-			if ((end_tick - start_tick) >= 10)
-				break;
+			hi = mid - 1;
 		}
 	}
-
-	check_child(true);
-
-	stop_threads();
-
+	bool ok = (found >= 0) && log_read_index(idx_fd, found, rec);
+	close(idx_fd);
+	if (!ok)
+	{
+		fprintf(stderr, "No keyframe before `%s` in `%s`\n", pos, idx_name);
+		return 3;
+	}
 	return 0;
 }
 
-// switch `--keys` useful to check keyboard translations
-static int test_read_keys()
+// switch `--log-seek <out-log> <offset|hh:mm:ss>` finds the nearest keyframe
+// in the sidecar index and prints the log from it, terminal modes are restored first
+static int seek_log_file(const char* path, const char* pos)
 {
-	struct termios old = {0}, raw = {};
+	const char* name = strrchr(path, '/');
+	const char* ext = strstr(name ? name : path, ".log");
+	if (!ext)
+	{
+		fprintf(stderr, "`%s` is not a connector log file\n", path);
+		return 2;
+	}
 
-	print_version();
-	printf("Starting raw conin reader, press Ctrl+C to stop\n");
+	LogStream ls = {};
+	ls.ext_pos = ext - path;
+	char* idx_name = (char*)malloc(strlen(path) + 8);
+	memcpy(idx_name, path, ls.ext_pos);
+	strcpy(idx_name + ls.ext_pos, ".idx");
+	LogIndexRecord rec = {};
+	long long found = -1;
+	int iRc = seek_log_index(idx_name, pos, rec, found);
+	free(idx_name);
+	if (iRc)
+		return iRc;
+
+	ls.path = strdup(path);
+	char* segment = log_segment_name(ls, rec.segment);
+	FILE* f = segment ? fopen(segment, "rb") : NULL;
+	if (!f)
+	{
+		fprintf(stderr, "Can't open segment `%s`, was it removed by retention policy?\n", segment ? segment : path);
+		free(segment);
+		free(ls.path);
+		return 2;
+	}
 
-	if (tcgetattr(0, &old) < 0)
-		perror("tcgetattr()");
-	raw = old;
-	raw.c_lflag &= ~(ICANON|ECHO);
-	raw.c_cc[VMIN] = 1;
-	raw.c_cc[VTIME] = 0;
-	if (tcsetattr(0, TCSANOW, &raw) < 0)
-		perror("tcsetattr()");
+	// Restore the terminal modes of the keyframe
+	char modes[256];
+	fwrite(modes, 1, format_term_modes(modes, rec.modes), stdout);
 
-	for (;;)
+	unsigned char hdr[4] = {};
+	bool compressed = (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) && (lz4_read32(hdr) == LZ4F_MAGIC);
+	fseek(f, rec.file_offset, SEEK_SET);
+	fprintf(stderr, "keyframe #%lli: offset=%lli segment=%i file_offset=%lli\n", found, rec.offset, rec.segment, rec.file_offset);
+
+	const int max_block = LOG_BLOCK_SIZE;
+	char* packed = (char*)malloc(max_block);
+	char* unpacked = (char*)malloc(max_block);
+	if (compressed)
 	{
-		int c = fgetc(stdin);
-		if (c > 32 && c != 0x7F)
-			printf("<x%02X:%c>", c, c);
-		else if (c == 0xA)
-			printf("<ENTER>\n");
-		else
-			printf("<x%02X>", c);
+		iRc = cat_lz4_blocks(f, segment, 0x60, packed, unpacked, max_block);
 	}
+	else
+	{
+		size_t len;
+		while ((len = fread(packed, 1, max_block, f)) > 0)
+			fwrite(packed, 1, len, stdout);
+	}
+	fclose(f);
+	free(segment);
+	free(packed);
+	free(unpacked);
 
-	if (tcsetattr(0, TCSADRAIN, &old) < 0)
-		perror ("reverting tcsetattr()");
+	// Following segments
+	for (int n = rec.segment + 1; !iRc; ++n)
+	{
+		segment = log_segment_name(ls, n);
+		bool exists = segment && (access(segment, R_OK) == 0);
+		if (exists)
+		{
+			fflush(stdout);
+			iRc = cat_log_file(segment);
+		}
+		free(segment);
+		if (!exists)
+			break;
+	}
 
-	return 0;
+	free(ls.path);
+	return iRc;
 }
 
 static void print_version()
@@ -941,6 +7525,214 @@ static int print_isatty(bool bChild)
 }
 
 
+// switch `--env-cache`: environment of the login shell is captured once and
+// later shells are started as non-login ones with that environment applied.
+// Cache is keyed by profile files (mtime and size) and by few variables
+// the profiles depend on, so any change of them starts new capture.
+static bool env_cache = false;
+#define ENV_CACHE_MAGIC "CEENV01"
+static const char* env_cache_skip[] = {"_", "SHLVL", "PWD", "OLDPWD", "TERM", "CHERE_INVOKING", NULL};
+
+static char* env_cache_path()
+{
+	const char* home = getenv("HOME");
+	if (!home || !*home)
+		return NULL;
+	char* path = (char*)malloc(strlen(home) + 64);
+	if (!path)
+		return NULL;
+	sprintf(path, "%s/.cache", home);
+	mkdir(path, 0700);
+	strcat(path, "/conemu-connector");
+	mkdir(path, 0700);
+	strcat(path, "/login.env");
+	return path;
+}
+
+static void env_cache_stat(char*& keys, int& keys_len, int& keys_max, const char* path)
+{
+	struct stat st = {};
+	bool exists = (stat(path, &st) == 0);
+	int need = strlen(path) + 64;
+	if (keys_len + need > keys_max)
+	{
+		keys_max = (keys_len + need) * 2;
+		keys = (char*)realloc(keys, keys_max);
+	}
+	keys_len += sprintf(keys + keys_len, "%s:%lld:%lld;", path,
+		exists ? (long long)st.st_mtime : -1LL, exists ? (long long)st.st_size : -1LL);
+}
+
+static unsigned env_cache_key()
+{
+	const char* home = getenv("HOME");
+	const char* home_files[] = {".bash_profile", ".bash_login", ".profile", ".bashrc", NULL};
+	const char* vars[] = {"HOME", "PATH", "TERM", "USER", NULL};
+	int keys_len = 0, keys_max = 1024;
+	char* keys = (char*)malloc(keys_max);
+	char path[1024];
+
+	env_cache_stat(keys, keys_len, keys_max, "/etc/profile");
+	env_cache_stat(keys, keys_len, keys_max, "/etc/bash.bashrc");
+	env_cache_stat(keys, keys_len, keys_max, "/etc/profile.d");
+	DIR* dir = opendir("/etc/profile.d");
+	if (dir)
+	{
+		struct dirent* ent;
+		while ((ent = readdir(dir)) != NULL)
+		{
+			if (ent->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/etc/profile.d/%s", ent->d_name);
+			env_cache_stat(keys, keys_len, keys_max, path);
+		}
+		closedir(dir);
+	}
+	for (int i = 0; home && home_files[i]; ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", home, home_files[i]);
+		env_cache_stat(keys, keys_len, keys_max, path);
+	}
+	for (int i = 0; vars[i]; ++i)
+	{
+		const char* value = getenv(vars[i]);
+		snprintf(path, sizeof(path), "%s=%s", vars[i], value ? value : "");
+		env_cache_stat(keys, keys_len, keys_max, path);
+	}
+
+	unsigned key = lz4_xxh32(keys, keys_len, 0);
+	free(keys);
+	return key;
+}
+
+// Runs the login shell in the background and stores its environment.
+// The capturing process leaves the session of the pty, so it's invisible to the user.
+static void env_cache_capture(const char* shell, unsigned key)
+{
+	pid_t capture = fork();
+	if (capture != 0)
+		return;
+
+	setsid();
+	int null_fd = open("/dev/null", O_RDWR);
+	for (int f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+		dup2(null_fd, f);
+	unsetenv("CHERE_INVOKING");
+
+	char* path = env_cache_path();
+	int out[2];
+	if (!path || pipe(out) != 0)
+		_exit(1);
+
+	long long start = get_time_us();
+	pid_t login = fork();
+	if (login == 0)
+	{
+		dup2(out[1], STDOUT_FILENO);
+		close(out[0]); close(out[1]);
+		execl(shell, shell, "-l", "-c", "exec env -0", (char*)NULL);
+		_exit(127);
+	}
+	close(out[1]);
+
+	int used = 0, size = 64*1024;
+	char* env = (char*)malloc(size);
+	ssize_t len;
+	while (env && (len = read(out[0], env + used, size - used)) > 0)
+	{
+		used += len;
+		if (used == size)
+			env = (char*)realloc(env, (size *= 2));
+	}
+	close(out[0]);
+	int status = -1;
+	waitpid(login, &status, 0);
+	unsigned elapsed_ms = (unsigned)((get_time_us() - start) / 1000);
+	if (!env || !used || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		_exit(1);
+
+	// Write and rename, concurrent connectors never see partial cache
+	char* tmp_path = (char*)malloc(strlen(path) + 32);
+	sprintf(tmp_path, "%s.%u", path, getpid());
+	FILE* f = fopen(tmp_path, "wb");
+	if (!f)
+		_exit(1);
+	fprintf(f, "%s key=%08x ms=%u\n", ENV_CACHE_MAGIC, key, elapsed_ms);
+	fwrite(env, 1, used, f);
+	if (fclose(f) != 0 || rename(tmp_path, path) != 0)
+		unlink(tmp_path);
+	_exit(0);
+}
+
+// Called in the child before execvp, returns true if cached environment
+// was applied and the shell may be started as non-login one
+static bool env_cache_apply(const char* shell)
+{
+	unsigned key = env_cache_key();
+	char* path = env_cache_path();
+	FILE* f = path ? fopen(path, "rb") : NULL;
+	unsigned cached_key = 0, saved_ms = 0;
+	bool hit = f && (fscanf(f, ENV_CACHE_MAGIC " key=%x ms=%u", &cached_key, &saved_ms) == 2)
+		&& (cached_key == key) && (fgetc(f) == '\n');
+	if (!hit)
+	{
+		if (f)
+			fclose(f);
+		free(path);
+		if (verbose)
+			write_verbose("\033[33;40m{PID:%u} env-cache: miss (key=%08x), capturing in background\033[m\r\n", getpid(), key);
+		env_cache_capture(shell, key);
+		return false;
+	}
+
+	long long start = get_time_us();
+	const char* cwd = NULL;
+	int count = 0, used = 0, size = 64*1024;
+	char* env = (char*)malloc(size + 1);
+	size_t len;
+	while (env && (len = fread(env + used, 1, size - used, f)) > 0)
+	{
+		used += len;
+		if (used == size)
+			env = (char*)realloc(env, (size *= 2) + 1);
+	}
+	fclose(f);
+	free(path);
+	if (env)
+		env[used] = 0;
+
+	for (char* entry = env; env && entry < env + used; entry += strlen(entry) + 1)
+	{
+		char* eq = strchr(entry, '=');
+		if (!eq || eq == entry)
+			continue;
+		*eq = 0;
+		bool skip = false;
+		for (int i = 0; env_cache_skip[i] && !skip; ++i)
+			skip = (strcmp(entry, env_cache_skip[i]) == 0);
+		if (!skip)
+		{
+			setenv(entry, eq + 1, true);
+			++count;
+		}
+		else if (strcmp(entry, "PWD") == 0)
+		{
+			cwd = eq + 1;
+		}
+		*eq = '=';
+	}
+
+	// The login profile changes directory unless CHERE_INVOKING is set
+	if (cwd && !getenv("CHERE_INVOKING"))
+		chdir(cwd);
+	free(env);
+
+	if (verbose || show_stats)
+		write_verbose("\033[33;40m{PID:%u} env-cache: hit, %i variables applied in %u ms, ~%u ms saved\033[m\r\n",
+			getpid(), count, (unsigned)((get_time_us() - start) / 1000), saved_ms);
+	return true;
+}
+
 #if !defined(HAS_FORKPTY)
 static int ce_createpty(const char* adescr, int *pmaster, int *pslave, struct winsize *winp)
 {
@@ -1010,8 +7802,8 @@ void child_reset(int a_slave_out = STDOUT_FILENO, int a_slave_err = STDERR_FILEN
 {
 	pid = 0;
 
+	// gb_sigusr1 was cleared before fork, the parent may have thawed us already
 	signal(SIGUSR1, sigusr1);
-	gb_sigusr1 = false;
 
 	slave_std_out = a_slave_out;
 	slave_std_err = a_slave_err;
@@ -1104,7 +7896,8 @@ static int ce_forkpty(int *pmaster, int *pmaster_err, struct winsize *winp)
 
 		// Wait a little until parent process let us go
 		tBegin = GetTickCount();
-		sleep(5);
+		if (!gb_sigusr1)
+			sleep(5);
 		tEnd = GetTickCount();
 		if (verbose)
 		{
@@ -1252,11 +8045,13 @@ void create_log_file(const char* pszDir)
 	if (verbose)
 		write_verbose("{PID:%u} creating logs in: %s\r\n", getpid(), pszLog);
 
+	start_log_writer();
+
 	for (int f = 0; f <= 1; ++f)
 	{
 		int& gnLogFile = !f ? gnLogFileIn : gnLogFileOut;
 
-		sprintf(pszLog+iDirLen, "connector-%u-%s.log", getpid(), !f ? "in" : "out");
+		sprintf(pszLog+iDirLen, "connector-%u-%s.log%s", getpid(), !f ? "in" : "out", log_compress ? ".lz4" : "");
 
 		// Let's create log file...
 		// umask(777); -- no need to reset?
@@ -1264,8 +8059,29 @@ void create_log_file(const char* pszDir)
 		// Succeeded?
 		if (gnLogFile >= 0)
 		{
-			// There is some permission crazyness while creating new files
-			fchmod(gnLogFile, 0600);
+			log_segment_started(gnLogFile);
+
+			// Remember the name, following segments are created by log_rotate
+			LogStream& ls = log_streams[f];
+			ls.path = strdup(pszLog);
+			ls.ext_pos = strstr(pszLog + iDirLen, ".log") - pszLog;
+			ls.segment = 0;
+			ls.opened = time(0);
+
+			// Sidecar index for the out-log, the writer thread is required to know file offsets
+			if (f == 1 && log_writer_pid == getpid())
+			{
+				strcpy(pszLog + ls.ext_pos, ".idx");
+				ls.idx_fd = open(pszLog, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+				if (ls.idx_fd >= 0)
+				{
+					fchmod(ls.idx_fd, 0600);
+					write(ls.idx_fd, LOG_INDEX_MAGIC, sizeof(LOG_INDEX_MAGIC) - 1);
+				}
+				if (verbose)
+					write_verbose("{PID:%u} fopen(`%s`) = %i\r\n", getpid(), pszLog, ls.idx_fd);
+				strcpy(pszLog, ls.path);
+			}
 
 			// Write our full command line to first line of log-file
 			if ((pszCmdLine = GetCommandLineW()) != NULL)
@@ -1277,8 +8093,8 @@ void create_log_file(const char* pszDir)
 					char* pszUtf8 = (char*)malloc(len*sizeof(*pszUtf8));
 					if (pszUtf8 && ((len = WideCharToMultiByte(CP_UTF8, 0, pszCmdLine, wlen, pszUtf8, len, 0, 0)) > 0))
 					{
-						write(gnLogFile, pszUtf8, len);
-						write(gnLogFile, "\n----------\n", 12);
+						write_log(gnLogFile, pszUtf8, len);
+						write_log(gnLogFile, "\n----------\n", 12);
 					}
 					free(pszUtf8);
 				}
@@ -1351,6 +8167,10 @@ int main(int argc, char** argv)
 	char** cur_argv;
 	bool prn_env = false;
 	bool wsl_bridge = false;
+	bool log_requested = false;
+	char* log_dir = NULL;
+	bool detach_requested = false, attach_requested = false, serve_requested = false;
+	const char* session_name = NULL;
 
 	cur_argv = argv[0] ? argv+1 : argv;
 	while (cur_argv[0])
@@ -1387,6 +8207,109 @@ int main(int argc, char** argv)
 		{
 			verbose = true;
 		}
+		else if (strcmp(cur_argv[0], "--stats") == 0)
+		{
+			show_stats = true;
+		}
+		else if (strcmp(cur_argv[0], "--proc-monitor") == 0)
+		{
+			int sec = (cur_argv[1] && isdigit((unsigned char)cur_argv[1][0])) ? atoi((++cur_argv)[0]) : 2;
+			proc_monitor.interval_us = _max(sec, 1) * 1000000LL;
+		}
+		else if (strcmp(cur_argv[0], "--trace") == 0)
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} --trace requires a file name\r\n", getpid());
+				exit(255);
+			}
+			if (!trace.events)
+				start_trace(cur_argv[1]);
+			cur_argv++;
+		}
+		else if (strcmp(cur_argv[0], "--env-cache") == 0)
+		{
+			env_cache = true;
+		}
+		else if (strcmp(cur_argv[0], "--no-cwd") == 0)
+		{
+			cwd_tracker.enabled = false;
+		}
+		else if (strcmp(cur_argv[0], "--sgr-minimize") == 0)
+		{
+			sgr_min.enabled = true;
+		}
+		else if (strcmp(cur_argv[0], "--sgr-check") == 0)
+		{
+			pid = 0;
+			exit(run_sgr_check((cur_argv[1] && cur_argv[1][0] != '-') ? cur_argv[1] : NULL));
+		}
+		else if ((strcmp(cur_argv[0], "--trigger") == 0) || (strcmp(cur_argv[0], "--trigger-re") == 0)
+			|| (strcmp(cur_argv[0], "--trigger-hook") == 0))
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} %s requires an argument\r\n", getpid(), cur_argv[0]);
+				exit(255);
+			}
+			if (strcmp(cur_argv[0], "--trigger-hook") == 0)
+				trigger.hook = cur_argv[1];
+			else if (!trigger_add(cur_argv[1], strcmp(cur_argv[0], "--trigger-re") == 0))
+				exit(255);
+			cur_argv++;
+		}
+		else if (strcmp(cur_argv[0], "--cmd-csv") == 0)
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} --cmd-csv requires a file name\r\n", getpid());
+				exit(255);
+			}
+			cmd_timing.csv_path = (++cur_argv)[0];
+		}
+		else if (strcmp(cur_argv[0], "--max-payload") == 0)
+		{
+			if (!cur_argv[1] || !isdigit(cur_argv[1][0]))
+			{
+				printf("{PID:%u} --max-payload requires size in KB\r\n", getpid());
+				exit(255);
+			}
+			payload.limit = atoll((++cur_argv)[0]) * 1024;
+		}
+		else if (strcmp(cur_argv[0], "--no-local-queries") == 0)
+		{
+			queries.enabled = false;
+		}
+		else if (strcmp(cur_argv[0], "--no-background") == 0)
+		{
+			background.enabled = false;
+		}
+		else if (strcmp(cur_argv[0], "--no-cmd-timing") == 0)
+		{
+			cmd_timing.enabled = false;
+		}
+		else if (strcmp(cur_argv[0], "--filter") == 0)
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} --filter requires a library name\r\n", getpid());
+				exit(255);
+			}
+			if (!load_filter((++cur_argv)[0]))
+				exit(255);
+		}
+		else if (strcmp(cur_argv[0], "--predict-echo") == 0)
+		{
+			predict.enabled = true;
+		}
+		else if (strcmp(cur_argv[0], "--no-squash") == 0)
+		{
+			progress.enabled = false;
+		}
+		else if (strcmp(cur_argv[0], "--no-sync-output") == 0)
+		{
+			sync_output.enabled = false;
+		}
 		else if (strcmp(cur_argv[0], "--environ") == 0)
 		{
 			prn_env = true;
@@ -1402,11 +8325,11 @@ int main(int argc, char** argv)
 		{
 			// User may or may not specify directory for log files
 			char* pszDir = (cur_argv[1] && (cur_argv[1][0] != '-')) ? cur_argv[1] : NULL;
-			if (gnLogFileOut == -1)
+			if (!log_requested)
 			{
-				// "[dir/]connector-%pid%-in.log"
-				// "[dir/]connector-%pid%-out.log"
-				create_log_file(pszDir);
+				// Files are created after all switches are processed
+				log_requested = true;
+				log_dir = pszDir;
 			}
 			else
 			{
@@ -1415,6 +8338,114 @@ int main(int argc, char** argv)
 			if (pszDir)
 				cur_argv++;
 		}
+		else if (strcmp(cur_argv[0], "--log-compress") == 0)
+		{
+			log_compress = true;
+		}
+		else if ((strcmp(cur_argv[0], "--log-size") == 0) || (strcmp(cur_argv[0], "--log-age") == 0) || (strcmp(cur_argv[0], "--log-keep") == 0))
+		{
+			const char* sw = cur_argv[0];
+			cur_argv++;
+			if (!cur_argv[0])
+				break;
+			int value = atoi(cur_argv[0]);
+			if (value < 0)
+				value = 0;
+			if (strcmp(sw, "--log-size") == 0)
+				log_max_size = (off_t)value * 1024 * 1024;
+			else if (strcmp(sw, "--log-age") == 0)
+				log_max_age = value * 60;
+			else
+				log_keep = value;
+		}
+		else if (strcmp(cur_argv[0], "--bench") == 0)
+		{
+			int iterations = (cur_argv[1] && isdigit(cur_argv[1][0])) ? atoi(cur_argv[1]) : 0;
+			exit(run_benchmarks(iterations));
+		}
+		else if (strcmp(cur_argv[0], "--bench-pty") == 0)
+		{
+			const char* workload = (cur_argv[1] && cur_argv[1][0] != '-') ? cur_argv[1] : NULL;
+			int size_mb = (workload && cur_argv[2] && isdigit(cur_argv[2][0])) ? atoi(cur_argv[2]) : 0;
+			exit(run_pty_benchmarks(workload, size_mb));
+		}
+		else if (strcmp(cur_argv[0], "--bench-input") == 0)
+		{
+			const char* pattern = (cur_argv[1] && cur_argv[1][0] != '-') ? cur_argv[1] : NULL;
+			int rate = (pattern && cur_argv[2] && isdigit(cur_argv[2][0])) ? atoi(cur_argv[2]) : 0;
+			int count = (rate && cur_argv[3] && isdigit(cur_argv[3][0])) ? atoi(cur_argv[3]) : 0;
+			exit(run_input_benchmarks(pattern, rate, count));
+		}
+		else if (strcmp(cur_argv[0], "--simulate") == 0)
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} --simulate requires a script file name\r\n", getpid());
+				exit(255);
+			}
+			exit(run_simulation(cur_argv[1]));
+		}
+		else if ((strcmp(cur_argv[0], "--detach") == 0) || (strcmp(cur_argv[0], "--attach") == 0))
+		{
+			if (strcmp(cur_argv[0], "--detach") == 0)
+				detach_requested = true;
+			else
+				attach_requested = true;
+			if (cur_argv[1] && cur_argv[1][0] != '-' && !strchr(cur_argv[1], '/'))
+				session_name = (++cur_argv)[0];
+		}
+		else if ((strcmp(cur_argv[0], "--connect") == 0) || (strcmp(cur_argv[0], "--serve") == 0))
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} %s requires socket path or host:port\r\n", getpid(), cur_argv[0]);
+				exit(255);
+			}
+			if (strcmp(cur_argv[0], "--connect") == 0)
+				attach_requested = true;
+			else
+				serve_requested = true;
+			session_name = (++cur_argv)[0];
+		}
+		else if (strcmp(cur_argv[0], "--session-key") == 0)
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} --session-key requires file name\r\n", getpid());
+				exit(255);
+			}
+			if (!load_session_key((++cur_argv)[0]))
+				exit(255);
+		}
+		else if (strcmp(cur_argv[0], "--serve-remote") == 0)
+		{
+			serve_remote = true;
+		}
+		else if (strcmp(cur_argv[0], "--sessions") == 0)
+		{
+			pid = 0;
+			exit(find_sessions(true, NULL) ? 0 : 1);
+		}
+		else if (strcmp(cur_argv[0], "--log-seek") == 0)
+		{
+			if (!cur_argv[1] || !cur_argv[2])
+			{
+				printf("{PID:%u} --log-seek requires file name and position\r\n", getpid());
+				exit(255);
+			}
+			pid = 0;
+			exit(seek_log_file(cur_argv[1], cur_argv[2]));
+		}
+		else if (strcmp(cur_argv[0], "--cat-log") == 0)
+		{
+			if (!cur_argv[1])
+			{
+				printf("{PID:%u} --cat-log requires file name\r\n", getpid());
+				exit(255);
+			}
+			pid = 0;
+			exit(cat_log_file(cur_argv[1]));
+		}
 		else if (strcmp(cur_argv[0], "-t") == 0)
 		{
 			cur_argv++;
@@ -1430,6 +8461,23 @@ int main(int argc, char** argv)
 				break;
 			work_dir = cur_argv[0];
 		}
+		else if ((strcmp(cur_argv[0], "--exit-policy") == 0))
+		{
+			cur_argv++;
+			if (!cur_argv[0])
+				break;
+			if (strcmp(cur_argv[0], "shell") == 0)
+				exit_policy = ep_Shell;
+			else if (strcmp(cur_argv[0], "session") == 0)
+				exit_policy = ep_Session;
+			else if (strcmp(cur_argv[0], "pty") == 0)
+				exit_policy = ep_Pty;
+			else
+			{
+				printf("{PID:%u} Unknown exit policy: %s\r\n", getpid(), cur_argv[0]);
+				exit(255);
+			}
+		}
 		else if ((strcmp(cur_argv[0], "--shlvl") == 0))
 		{
 			setenv("SHLVL", "1", true);
@@ -1463,12 +8511,62 @@ int main(int argc, char** argv)
 			printf("                   forces `set CHERE_INVOKING=1`\n");
 			printf("  -l, --log <dir>  write console IN and OUT to files in `dir` folder\n");
 			printf("                   use current folder if <dir> is not specified`\n");
+			printf("      --log-compress  write logs in LZ4 frame format (*.log.lz4)\n");
+			printf("      --log-size <MB>   start new log segment when size exceeds MB\n");
+			printf("      --log-age <min>   start new log segment every `min` minutes\n");
+			printf("      --log-keep <n>    keep only `n` last log segments\n");
+			printf("      --cat-log <file>  print the log file, unpack compressed logs\n");
+			printf("      --log-seek <out-log> <offset|hh:mm:ss>  print the log file from the\n");
+			printf("                   nearest keyframe of its index (*.idx)\n");
 			printf("  -t <new-term>    forces `set TERM=new-term`\n");
+			printf("      --detach [name]  run the shell in background session holder, it\n");
+			printf("                   survives closing of the tab (name is holder PID by default)\n");
+			printf("      --attach [name]  connect to the detached session and repaint it\n");
+			printf("                   the most recent session is used if `name` is omitted\n");
+			printf("      --sessions   list detached sessions\n");
+			printf("      --connect <path|host:port>  pump the backend speaking the session\n");
+			printf("                   protocol instead of starting the shell (\":port\" is loopback)\n");
+			printf("      --serve <name|path|host:port>  run the shell as the session backend,\n");
+			printf("                   in foreground, e.g. loopback stand-in for `--connect`\n");
+			printf("      --session-key <file>  shared secret for `--connect` and `--serve`, the first\n");
+			printf("                   line of the file, required for host:port; not encrypted\n");
+			printf("      --serve-remote  allow `--serve` on addresses other than loopback\n");
+			printf("      --exit-policy <shell|session|pty>  when to close the terminal:\n");
+			printf("                   shell   - the shell has exited (default)\n");
+			printf("                   session - no processes left in the shell's session\n");
+			printf("                   pty     - all processes closed the pty\n");
+			printf("                   connector exit code is the shell's one (128+N if killed by signal N)\n");
+			printf("      --bench [n]  run microbenchmarks with `n` iterations, print CSV\n");
+			printf("      --bench-pty [yes|seq|cat|ansi|json|all] [MB]\n");
+			printf("                   pump output of real producers into null host, print CSV\n");
+			printf("      --bench-input [single|burst|repeat|all] [keys/s] [count]\n");
+			printf("                   measure key-to-pty latency, idle and under output flood\n");
+			printf("      --simulate <script>  replay the pump with scripted shell and host on the virtual clock\n");
 			printf("      --debug      wait for debugger for 60 seconds\n");
+			printf("      --env-cache  start default shell as non-login one with cached environment\n");
+			printf("                   of login shell, cache is renewed when profile files change\n");
 			printf("      --environ    print environment on startup\n");
 			printf("      --isatty     do isatty checks and print pts names\n");
 			printf("      --keys       read conin and print bare input\n");
+			printf("      --no-cwd     pass cwd reports (OSC 7, OSC 9;9) as is, don't convert\n");
+			printf("      --trigger <text>  notify the host (OSC 9) when the output contains the text\n");
+			printf("      --trigger-re <regex>  the same for extended regular expression on one line\n");
+			printf("      --trigger-hook <command>  run the command instead of notification\n");
+			printf("      --cmd-csv <file>  append duration of commands (OSC 133 marks) to CSV file\n");
+			printf("      --no-cmd-timing  don't track commands by OSC 133 marks\n");
+			printf("      --no-background  pass all output to the host when the tab is hidden\n");
+			printf("      --no-local-queries  pass all terminal queries (DA, DSR, DECRQM) to the host\n");
+			printf("      --max-payload <KB>  drop the rest of longer escape sequence (images), default 0 - no limit\n");
+			printf("      --filter <library>[,arg]  add output filter, see ConnectorFilter.h\n");
+			printf("      --predict-echo  show typed keys before the echo of slow shell\n");
+			printf("      --no-squash  pass every progress bar redraw to the host\n");
+			printf("      --no-sync-output  pass synchronized updates (mode 2026) as they arrive\n");
+			printf("      --sgr-minimize  drop and merge redundant SGR (colors, attributes)\n");
+			printf("      --sgr-check [file]  verify the minimizer on the file or generated sample\n");
 			printf("      --shlvl      forces `set SHLVL=1` to avoid terminal reset on exit\n");
+			printf("      --stats      print performance statistics on exit\n");
+			printf("      --proc-monitor [sec]  sample CPU and memory of the shell processes\n");
+			printf("      --trace <file>  write Chrome trace-event timeline of the pump on exit\n");
 			printf("      --verbose    additional information during startup\n");
 			printf("      --version    print version of this tool\n");
 			printf("      --wsl        run wslbridge to start Bash on Ubuntu on Windows 10\n");
@@ -1484,17 +8582,38 @@ int main(int argc, char** argv)
 		cur_argv++;
 	}
 
+	// The shell of detached session is started by holder,
+	// this process only passes input and output of the tab
+	if (attach_requested && attach_session(session_name) != 0)
+		exit(253);
+	else if (serve_requested && !attach_requested && serve_session(session_name) != 0)
+		exit(253);
+	else if (detach_requested && !attach_requested && !serve_requested && start_holder(session_name) != 0)
+		exit(253);
+
+	if (log_requested)
+	{
+		// "[dir/]connector-%pid%-in.log"
+		// "[dir/]connector-%pid%-out.log"
+		create_log_file(log_dir);
+		// flush the logs even if we are exiting on errors
+		atexit(close_log_files);
+	}
+
 	// Request xterm emulation in ConEmu, obtain callback functions
-	if (RequestTermConnector() != 0)
+	if (!holder && RequestTermConnector() != 0)
 	{
 		exit(254);
 	}
 
-	tcgetattr(0, &attr);
-	attr.c_cc[VERASE] = CDEL;
-	attr.c_iflag = 0;
-	attr.c_lflag = ISIG;
-	tcsetattr(0, TCSANOW, &attr);
+	if (!holder)
+	{
+		tcgetattr(0, &attr);
+		attr.c_cc[VERASE] = CDEL;
+		attr.c_iflag = 0;
+		attr.c_lflag = ISIG;
+		tcsetattr(0, TCSANOW, &attr);
+	}
 
 	signal(SIGHUP, SIG_IGN);
 
@@ -1502,11 +8621,22 @@ int main(int argc, char** argv)
 	signal(SIGTERM, sigexit);
 	signal(SIGQUIT, sigexit);
 
-	SetConsoleCtrlHandler(CtrlHandlerRoutine, true);
+	if (!holder)
+		SetConsoleCtrlHandler(CtrlHandlerRoutine, true);
 
 	winsize winp = {25, 80};
 	query_console_size(&winp);
 
+	if (session_link.fd >= 0)
+	{
+		// Client of the detached session
+		signal(SIGPIPE, SIG_IGN);
+		sess_send_size(session_link.fd, &winp);
+		iMainRc = run();
+		StopTermConnector();
+		return iMainRc;
+	}
+
 	curTerm = getenv("TERM");
 	if (!curTerm || force_set_term)
 	{
@@ -1640,6 +8770,13 @@ int main(int argc, char** argv)
 			}
 		}
 
+		// Default login shell may be replaced with non-login one and cached environment
+		if (env_cache && !wsl_bridge && !cur_argv[0] && env_cache_apply(child_argv[0]))
+		{
+			static char * const cached_argv[] = {"/usr/bin/bash", "-i", NULL};
+			child_argv = cached_argv;
+		}
+
 		if (verbose)
 		{
 			print_isatty(true);
@@ -1728,7 +8865,7 @@ int main(int argc, char** argv)
 		// Thaw children
 		sigusr1_throw(pid);
 
-		iMainRc = run();
+		iMainRc = holder ? hold_session() : run();
 	}
 
 	StopTermConnector();
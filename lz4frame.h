@@ -0,0 +1,255 @@
+/*
+Copyright (c) 2015-present Maximus5
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. The name of the authors may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+/*
+Minimal self-contained LZ4 codec used for compressed log files.
+Only the features we need are implemented:
+* block compression with 64KiB independent blocks (no dictionary);
+* frame header without content size and checksums;
+* decompression of frames with independent blocks (checksums are skipped).
+Files are compatible with the reference `lz4`/`lz4cat` tools.
+See https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+*/
+
+#define LZ4F_MAGIC         0x184D2204U
+#define LZ4F_BLOCK_SIZE    (64*1024)
+#define LZ4F_HEADER_SIZE   7
+#define LZ4F_UNCOMPRESSED  0x80000000U
+// worst case of lz4_compress_block output
+#define LZ4_COMPRESS_BOUND(n) ((n) + ((n) / 255) + 16)
+
+static inline unsigned lz4_read32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static inline void lz4_write32(unsigned char* p, unsigned v)
+{
+	p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+}
+
+static inline unsigned lz4_rotl32(unsigned v, int r)
+{
+	return (v << r) | (v >> (32 - r));
+}
+
+// xxHash32, required for frame header checksum
+static unsigned lz4_xxh32(const void* data, int len, unsigned seed)
+{
+	const unsigned P1 = 2654435761U, P2 = 2246822519U, P3 = 3266489917U, P4 = 668265263U, P5 = 374761393U;
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* end = p + len;
+	unsigned h;
+
+	if (len >= 16)
+	{
+		unsigned v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+		const unsigned char* limit = end - 16;
+		do {
+			v1 = lz4_rotl32(v1 + lz4_read32(p) * P2, 13) * P1; p += 4;
+			v2 = lz4_rotl32(v2 + lz4_read32(p) * P2, 13) * P1; p += 4;
+			v3 = lz4_rotl32(v3 + lz4_read32(p) * P2, 13) * P1; p += 4;
+			v4 = lz4_rotl32(v4 + lz4_read32(p) * P2, 13) * P1; p += 4;
+		} while (p <= limit);
+		h = lz4_rotl32(v1, 1) + lz4_rotl32(v2, 7) + lz4_rotl32(v3, 12) + lz4_rotl32(v4, 18);
+	}
+	else
+	{
+		h = seed + P5;
+	}
+
+	h += (unsigned)len;
+
+	while (p + 4 <= end)
+	{
+		h = lz4_rotl32(h + lz4_read32(p) * P3, 17) * P4;
+		p += 4;
+	}
+	while (p < end)
+	{
+		h = lz4_rotl32(h + (*p) * P5, 11) * P1;
+		++p;
+	}
+
+	h ^= h >> 15; h *= P2;
+	h ^= h >> 13; h *= P3;
+	h ^= h >> 16;
+	return h;
+}
+
+// Frame header: magic, FLG (version 01, independent blocks), BD (64KiB blocks), HC
+static int lz4_frame_header(unsigned char* out)
+{
+	lz4_write32(out, LZ4F_MAGIC);
+	out[4] = 0x60;
+	out[5] = 0x40;
+	out[6] = (unsigned char)((lz4_xxh32(out + 4, 2, 0) >> 8) & 0xFF);
+	return LZ4F_HEADER_SIZE;
+}
+
+static unsigned char* lz4_write_length(unsigned char* op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*(op++) = 255;
+	*(op++) = (unsigned char)len;
+	return op;
+}
+
+// Returns compressed size or 0 if the data does not fit into `dst_max`
+static int lz4_compress_block(const char* source, int src_len, char* dest, int dst_max)
+{
+	const int min_match = 4, last_literals = 5, mf_limit = 12;
+	const int hash_log = 12;
+	unsigned table[1 << hash_log];  // position+1, zero means empty
+	const unsigned char* src = (const unsigned char*)source;
+	unsigned char* op = (unsigned char*)dest;
+	unsigned char* op_end = op + dst_max;
+	int anchor = 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (src_len > mf_limit)
+	{
+		const int limit = src_len - mf_limit;
+		const int match_limit = src_len - last_literals;
+		int ip = 0;
+		while (ip < limit)
+		{
+			unsigned seq = lz4_read32(src + ip);
+			unsigned h = (seq * 2654435761U) >> (32 - hash_log);
+			int ref = (int)table[h] - 1;
+			table[h] = ip + 1;
+			if (ref < 0 || (ip - ref) > 0xFFFF || lz4_read32(src + ref) != seq)
+			{
+				++ip;
+				continue;
+			}
+
+			int match_len = min_match;
+			while ((ip + match_len < match_limit) && (src[ref + match_len] == src[ip + match_len]))
+				++match_len;
+
+			int lit_len = ip - anchor;
+			if ((op + 1 + (lit_len / 255 + 1) + lit_len + 2 + (match_len / 255 + 1)) > op_end)
+				return 0;
+
+			unsigned char* token = op++;
+			*token = (unsigned char)(((lit_len >= 15) ? 15 : lit_len) << 4);
+			if (lit_len >= 15)
+				op = lz4_write_length(op, lit_len - 15);
+			memcpy(op, src + anchor, lit_len);
+			op += lit_len;
+
+			op[0] = (unsigned char)(ip - ref);
+			op[1] = (unsigned char)((ip - ref) >> 8);
+			op += 2;
+
+			int ml = match_len - min_match;
+			*token |= (unsigned char)((ml >= 15) ? 15 : ml);
+			if (ml >= 15)
+				op = lz4_write_length(op, ml - 15);
+
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	// Last literals
+	int lit_len = src_len - anchor;
+	if ((op + 1 + (lit_len / 255 + 1) + lit_len) > op_end)
+		return 0;
+	*(op++) = (unsigned char)(((lit_len >= 15) ? 15 : lit_len) << 4);
+	if (lit_len >= 15)
+		op = lz4_write_length(op, lit_len - 15);
+	memcpy(op, src + anchor, lit_len);
+	op += lit_len;
+
+	return (int)(op - (unsigned char*)dest);
+}
+
+// Returns decompressed size or -1 on malformed input
+static int lz4_decompress_block(const char* source, int src_len, char* dest, int dst_max)
+{
+	const unsigned char* ip = (const unsigned char*)source;
+	const unsigned char* ip_end = ip + src_len;
+	unsigned char* op = (unsigned char*)dest;
+	unsigned char* op_end = op + dst_max;
+
+	while (ip < ip_end)
+	{
+		unsigned token = *(ip++);
+		int len = token >> 4;
+		if (len == 15)
+		{
+			unsigned b;
+			do {
+				if (ip >= ip_end)
+					return -1;
+				b = *(ip++);
+				len += b;
+			} while (b == 255);
+		}
+		if ((ip + len > ip_end) || (op + len > op_end))
+			return -1;
+		memcpy(op, ip, len);
+		op += len; ip += len;
+
+		if (ip >= ip_end)
+			break; // last sequence has literals only
+
+		if (ip + 2 > ip_end)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (op - (unsigned char*)dest))
+			return -1;
+
+		len = token & 15;
+		if (len == 15)
+		{
+			unsigned b;
+			do {
+				if (ip >= ip_end)
+					return -1;
+				b = *(ip++);
+				len += b;
+			} while (b == 255);
+		}
+		len += 4;
+		if (op + len > op_end)
+			return -1;
+		// match may overlap with the output, copy byte by byte
+		const unsigned char* match = op - offset;
+		while (len-- > 0)
+			*(op++) = *(match++);
+	}
+
+	return (int)(op - (unsigned char*)dest);
+}